@@ -1,11 +1,32 @@
 #include <xapian.h>
 #include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/sendfile.h>
+#include <ftw.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <cstdio>
+#include <cstdint>
 #include <cstring>
 #include <regex>
 #include <algorithm>
 #include <exception>
 #include <cstdarg>
+#include <cerrno>
+#include <unordered_map>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#if defined(__x86_64__) && defined(__SSE2__)
+    #include <immintrin.h>
+#endif
 #include <liquid/liquid.h>
 
 #include "ngx_xapian_search.h"
@@ -13,8 +34,9 @@
 using namespace std;
 using namespace Xapian;
 
-bool has_error = false;
-char error_buffer[1024];
+// Searches may run on any number of threads at once (nginx's thread pools), so errors, and everything kept between searches, are per thread.
+thread_local bool has_error = false;
+thread_local char error_buffer[1024];
 
 const char* ngx_xapian_get_error() {
     if (!has_error)
@@ -64,8 +86,22 @@ struct SearchResult {
     string description;
     string url;
 
+    void clear() {
+        path.clear();
+        title.clear();
+        description.clear();
+        url.clear();
+    }
+
     string pack() const {
         string buffer;
+        pack(buffer);
+        return buffer;
+    }
+
+    // Into a buffer that's reused from one document to the next.
+    void pack(string& buffer) const {
+        buffer.clear();
         buffer.reserve(sizeof(int)*4 + path.size() + title.size() + description.size() + url.size());
         int size = path.size();
         buffer.append((char*)&size, sizeof(size));
@@ -79,7 +115,6 @@ struct SearchResult {
         buffer.append(title);
         buffer.append(description);
         buffer.append(url);
-        return buffer;
     }
     static SearchResult unpack(const string& data) {
         int offset = 0;
@@ -103,42 +138,234 @@ struct SearchResult {
     }
 };
 
-string extract_meta_attribute(const string& document, const string& attribute) {
-    string regexBuffer = string("<meta\\s+.*name=[\"']") + attribute + "[\"']\\s+content\\s*=\\s*";
-    auto metaRegex = regex(regexBuffer.data());
-    smatch match;
-    if (regex_search(document, match, metaRegex)) {
-        unsigned int initial = match.position(0) + match.length(0);
-        char delimiter = document[initial];
-        if (delimiter == '"' || delimiter == '\'') {
-            for (unsigned int i = initial+1; i < document.size(); ++i) {
-                    if (document[i] == delimiter && (i == 0 || document[i-1] != '\\')) {
-                        return string(&document[initial+1], min((int)(i - initial - 1), 1024));
-                    }
+// Pulls the title, every <meta name> and every <link rel> we care about out of the document in a single linear pass, stopping
+// as soon as we hit </head> (or <body>, for documents that leave out the head tags entirely).
+struct HeadScanner {
+    static constexpr size_t MAX_FIELD_LENGTH = 1024;
+
+    string keywords;
+    string robots;
+    string language;
+
+    const char* buffer;
+    size_t size;
+    size_t offset;
+
+    void clear() {
+        keywords.clear();
+        robots.clear();
+        language.clear();
+    }
+
+    static bool equals(const char* str, size_t length, const char* name) {
+        return strlen(name) == length && strncasecmp(str, name, length) == 0;
+    }
+
+    static bool containsToken(const char* str, size_t length, const char* token) {
+        size_t tokenLength = strlen(token);
+        for (size_t i = 0; i + tokenLength <= length; ++i) {
+            if (strncasecmp(&str[i], token, tokenLength) == 0 && (i == 0 || isspace((unsigned char)str[i-1])) && (i + tokenLength == length || isspace((unsigned char)str[i+tokenLength])))
+                return true;
+        }
+        return false;
+    }
+
+    static void assign(string& field, const char* value, size_t length) {
+        if (field.empty())
+            field.assign(value, min(length, MAX_FIELD_LENGTH));
+    }
+
+    void skipWhitespace() {
+        while (offset < size && isspace((unsigned char)buffer[offset]))
+            ++offset;
+    }
+
+    void skipPast(const char* terminator) {
+        size_t length = strlen(terminator);
+        while (offset < size) {
+            const char* next = (const char*)memchr(&buffer[offset], terminator[0], size - offset);
+            if (!next) {
+                offset = size;
+                return;
             }
+            offset = next - buffer;
+            if (offset + length <= size && strncmp(next, terminator, length) == 0) {
+                offset += length;
+                return;
+            }
+            ++offset;
         }
     }
-    return string();
-}
 
+    size_t readName() {
+        size_t start = offset;
+        while (offset < size && !isspace((unsigned char)buffer[offset]) && buffer[offset] != '>' && buffer[offset] != '/' && buffer[offset] != '=')
+            ++offset;
+        return offset - start;
+    }
+
+    // Unlike a name, an unquoted value can contain '/' and '='; think content=text/html, or href=https://example.com/.
+    size_t readUnquotedValue() {
+        size_t start = offset;
+        while (offset < size && !isspace((unsigned char)buffer[offset]) && buffer[offset] != '>')
+            ++offset;
+        return offset - start;
+    }
+
+    // Reads the next attribute of the current tag; returns false once we've hit the end of the tag.
+    bool readAttribute(const char*& name, size_t& nameLength, const char*& value, size_t& valueLength) {
+        skipWhitespace();
+        while (offset < size && buffer[offset] == '/') {
+            ++offset;
+            skipWhitespace();
+        }
+        if (offset >= size || buffer[offset] == '>') {
+            offset = min(offset + 1, size);
+            return false;
+        }
+        name = &buffer[offset];
+        nameLength = readName();
+        value = nullptr;
+        valueLength = 0;
+        skipWhitespace();
+        if (offset < size && buffer[offset] == '=') {
+            ++offset;
+            skipWhitespace();
+            if (offset < size && (buffer[offset] == '"' || buffer[offset] == '\'')) {
+                char delimiter = buffer[offset++];
+                const char* end = (const char*)memchr(&buffer[offset], delimiter, size - offset);
+                value = &buffer[offset];
+                valueLength = (end ? end - buffer : size) - offset;
+                offset = min(offset + valueLength + 1, size);
+            } else {
+                value = &buffer[offset];
+                valueLength = readUnquotedValue();
+            }
+        }
+        if (nameLength == 0 && !value)
+            ++offset;
+        return true;
+    }
+
+    void meta(SearchResult& result) {
+        const char *name, *value, *metaName = nullptr, *content = nullptr;
+        size_t nameLength, valueLength, metaNameLength = 0, contentLength = 0;
+        bool contentLanguage = false;
+        while (readAttribute(name, nameLength, value, valueLength)) {
+            if (!value)
+                continue;
+            if (equals(name, nameLength, "name")) {
+                metaName = value;
+                metaNameLength = valueLength;
+            } else if (equals(name, nameLength, "content")) {
+                content = value;
+                contentLength = valueLength;
+            } else if (equals(name, nameLength, "http-equiv")) {
+                contentLanguage = equals(value, valueLength, "content-language");
+            }
+        }
+        if (!content)
+            return;
+        if (contentLanguage)
+            assign(language, content, contentLength);
+        if (!metaName)
+            return;
+        if (equals(metaName, metaNameLength, "description"))
+            assign(result.description, content, contentLength);
+        else if (equals(metaName, metaNameLength, "keywords"))
+            assign(keywords, content, contentLength);
+        else if (equals(metaName, metaNameLength, "robots") || equals(metaName, metaNameLength, "robot"))
+            assign(robots, content, contentLength);
+        else if (equals(metaName, metaNameLength, "language"))
+            assign(language, content, contentLength);
+    }
+
+    void link(SearchResult& result) {
+        const char *name, *value, *href = nullptr;
+        size_t nameLength, valueLength, hrefLength = 0;
+        bool canonical = false;
+        while (readAttribute(name, nameLength, value, valueLength)) {
+            if (!value)
+                continue;
+            if (equals(name, nameLength, "rel"))
+                canonical = containsToken(value, valueLength, "canonical");
+            else if (equals(name, nameLength, "href")) {
+                href = value;
+                hrefLength = valueLength;
+            }
+        }
+        if (canonical && href)
+            assign(result.url, href, hrefLength);
+    }
+
+    void title(SearchResult& result) {
+        skipPast(">");
+        size_t start = offset;
+        while (offset < size) {
+            skipPast("</");
+            if (offset + 5 <= size && strncasecmp(&buffer[offset], "title", 5) == 0) {
+                assign(result.title, &buffer[start], offset - 2 - start);
+                skipPast(">");
+                return;
+            }
+        }
+    }
 
-string extract_link_attribute(const string& document, const string& attribute) {
-    string regexBuffer = string("<link\\s+.*rel=[\"']") + attribute + "['\"]\\s+href\\s*=\\s*";
-    auto metaRegex = regex(regexBuffer.data());
-    smatch match;
-    if (regex_search(document, match, metaRegex)) {
-        unsigned int initial = match.position(0) + match.length(0);
-        char delimiter = document[initial];
-        if (delimiter == '"' || delimiter == '\'') {
-            for (unsigned int i = initial+1; i < document.size(); ++i) {
-                    if (document[i] == delimiter && (i == 0 || document[i-1] != '\\')) {
-                        return string(&document[initial+1], min((int)(i - initial - 1), 1024));
+    void scan(const char* buffer, size_t size, SearchResult& result) {
+        this->buffer = buffer;
+        this->size = size;
+        offset = 0;
+        const char* htmlLanguage = nullptr;
+        size_t htmlLanguageLength = 0;
+        while (offset < size) {
+            const char* next = (const char*)memchr(&buffer[offset], '<', size - offset);
+            if (!next)
+                break;
+            offset = next - buffer + 1;
+            if (offset >= size)
+                break;
+            if (buffer[offset] == '!') {
+                if (offset + 3 <= size && strncmp(&buffer[offset], "!--", 3) == 0)
+                    skipPast("-->");
+                else
+                    skipPast(">");
+                continue;
+            }
+            bool closing = buffer[offset] == '/';
+            if (closing)
+                ++offset;
+            const char* tag = &buffer[offset];
+            size_t tagLength = readName();
+            if (closing) {
+                if (equals(tag, tagLength, "head"))
+                    break;
+                skipPast(">");
+            } else if (equals(tag, tagLength, "meta")) {
+                meta(result);
+            } else if (equals(tag, tagLength, "link")) {
+                link(result);
+            } else if (equals(tag, tagLength, "title")) {
+                title(result);
+            } else if (equals(tag, tagLength, "html")) {
+                const char *name, *value;
+                size_t nameLength, valueLength;
+                while (readAttribute(name, nameLength, value, valueLength)) {
+                    if (value && equals(name, nameLength, "lang")) {
+                        htmlLanguage = value;
+                        htmlLanguageLength = valueLength;
                     }
+                }
+            } else if (equals(tag, tagLength, "body")) {
+                break;
+            } else {
+                skipPast(">");
             }
         }
+        // An explicit <meta name="language"> takes precedence over <html lang>.
+        if (htmlLanguage)
+            assign(language, htmlLanguage, htmlLanguageLength);
     }
-    return string();
-}
+};
 
 struct CoreException : public exception {
     string internal;
@@ -155,9 +382,79 @@ struct CoreException : public exception {
     const char* what() const throw() { return internal.c_str(); }
 };
 
+// A file that was there when the tree was walked, and has gone since; an ordinary part of a deploy, so it's skipped, rather than failing the build.
+struct MissingFileException : public CoreException {
+    MissingFileException(const char* path) : CoreException("File %s has disappeared.", path) { }
+};
+
+
+// Finds the next byte inside a tag that HTMLParser actually has to look at: whitespace (or any other control byte), '>', '=',
+// '/' or a quote. Checks a whole vector at a time; SSE2 is always there on x86_64, AVX2 is picked at runtime if the CPU has it,
+// and anything else falls back to the scalar loop.
+struct TagScanner {
+    typedef const char* (*Implementation)(const char* begin, const char* end);
+
+    static bool isDelimiter(unsigned char ch) {
+        return ch <= ' ' || ch == '>' || ch == '=' || ch == '/' || ch == '"' || ch == '\'';
+    }
+
+    static const char* scalar(const char* begin, const char* end) {
+        for (; begin < end && !isDelimiter(*begin); ++begin);
+        return begin;
+    }
+
+#if defined(__x86_64__) && defined(__SSE2__)
+    static const char* sse2(const char* begin, const char* end) {
+        const __m128i space = _mm_set1_epi8(' '), close = _mm_set1_epi8('>'), equals = _mm_set1_epi8('='), slash = _mm_set1_epi8('/'), doubleQuote = _mm_set1_epi8('"'), singleQuote = _mm_set1_epi8('\'');
+        for (; begin + 16 <= end; begin += 16) {
+            __m128i chunk = _mm_loadu_si128((const __m128i*)begin);
+            // Unsigned chunk <= ' ', so that UTF-8 continuation bytes don't count as control characters.
+            __m128i matches = _mm_cmpeq_epi8(_mm_min_epu8(chunk, space), chunk);
+            matches = _mm_or_si128(matches, _mm_or_si128(_mm_cmpeq_epi8(chunk, close), _mm_cmpeq_epi8(chunk, equals)));
+            matches = _mm_or_si128(matches, _mm_or_si128(_mm_cmpeq_epi8(chunk, slash), _mm_or_si128(_mm_cmpeq_epi8(chunk, doubleQuote), _mm_cmpeq_epi8(chunk, singleQuote))));
+            int mask = _mm_movemask_epi8(matches);
+            if (mask)
+                return begin + __builtin_ctz(mask);
+        }
+        return scalar(begin, end);
+    }
+
+    __attribute__((target("avx2"))) static const char* avx2(const char* begin, const char* end) {
+        const __m256i space = _mm256_set1_epi8(' '), close = _mm256_set1_epi8('>'), equals = _mm256_set1_epi8('='), slash = _mm256_set1_epi8('/'), doubleQuote = _mm256_set1_epi8('"'), singleQuote = _mm256_set1_epi8('\'');
+        for (; begin + 32 <= end; begin += 32) {
+            __m256i chunk = _mm256_loadu_si256((const __m256i*)begin);
+            __m256i matches = _mm256_cmpeq_epi8(_mm256_min_epu8(chunk, space), chunk);
+            matches = _mm256_or_si256(matches, _mm256_or_si256(_mm256_cmpeq_epi8(chunk, close), _mm256_cmpeq_epi8(chunk, equals)));
+            matches = _mm256_or_si256(matches, _mm256_or_si256(_mm256_cmpeq_epi8(chunk, slash), _mm256_or_si256(_mm256_cmpeq_epi8(chunk, doubleQuote), _mm256_cmpeq_epi8(chunk, singleQuote))));
+            unsigned int mask = _mm256_movemask_epi8(matches);
+            if (mask)
+                return begin + __builtin_ctz(mask);
+        }
+        return sse2(begin, end);
+    }
+#endif
+
+    static Implementation resolve() {
+#if defined(__x86_64__) && defined(__SSE2__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            return avx2;
+        return sse2;
+#else
+        return scalar;
+#endif
+    }
+
+    static const char* find(const char* begin, const char* end) {
+        static const Implementation implementation = resolve();
+        return implementation(begin, end);
+    }
+};
 
 // Allow for the "nointernalindex" class to be parsed out, as well as stripping all HTML tags.
 // This should potentially use an HTML parsing library. For now, just do a hack job for a 'good-enough' use.
+// Text is handed to the term generator as it's found, through a small bounded buffer, rather than being built up into a copy
+// of the whole document.
 struct HTMLParser {
     enum class EStringParsingState {
         OPEN,
@@ -170,147 +467,265 @@ struct HTMLParser {
         SCRIPT
     };
 
-    const char* buffer;
-    size_t offset;
-    size_t lastCopied;
+    // Text is flushed to the term generator in runs of roughly this size, always broken on whitespace.
+    static constexpr size_t TEXT_BUFFER_SIZE = 16*1024;
+    static constexpr long AWAITING_VALUE = -2;
+
+    TermGenerator& termGenerator;
+    // Whether body text keeps its positions; without them, it's cheaper to store and read, but can't be phrase searched.
+    bool positions;
     EStringParsingState strState;
     ETagParsingState tagState;
     int noIndexDepth;
+    // The element whose contents we skip over in the SCRIPT state; either script or style.
+    const char* rawTag;
+    size_t rawTagLength;
+    string text;
+
+    // Positions within the buffer currently being processed.
+    const char* buffer;
+    size_t offset;
+    size_t lastCopied;
+    size_t tagStart;
+    int tagNoIndexDepth;
+    bool tagNoIndex;
+    long tagNameStart;
+    long tagNameEnd;
+    long attrNameStart;
+    long attrNameEnd;
+    long attrValueStart;
 
-    string result;
-    int tagStart;
+    HTMLParser(TermGenerator& termGenerator, bool positions = true) : termGenerator(termGenerator), positions(positions), strState(EStringParsingState::OPEN), tagState(ETagParsingState::OPEN), noIndexDepth(-1), rawTag(nullptr), rawTagLength(0) {
+        text.reserve(TEXT_BUFFER_SIZE*2);
+    }
 
-    void copyUpTo(int place = -1) {
-        if (place == -1)
-            place = offset;
-        result.append(buffer, lastCopied, place - lastCopied);
-        result.push_back(' ');
-        lastCopied = offset;
+    // Ready for another document; the buffers keep their capacity.
+    void reset() {
+        strState = EStringParsingState::OPEN;
+        tagState = ETagParsingState::OPEN;
+        noIndexDepth = -1;
+        rawTag = nullptr;
+        rawTagLength = 0;
+        text.clear();
     }
 
-    void attr(const char* attrName, int attrNameLength, const char* attrValue, int attrValueLength) {
-        if (noIndexDepth == -1 && attrNameLength == 5 && strncmp(attrName, "class", 5) == 0) {
-            static constexpr int strLength = sizeof("nointernalindex")-1;
-            for (int i = 0; i < attrValueLength - strLength + 1; ++i) {
-                if (strncmp(&attrValue[i], "nointernalindex", strLength) == 0 &&
-                    ((i == attrValueLength - strLength) || isblank(attrValue[i+strLength+1])) &&
-                    (i == 0 || isblank(attrValue[i-1]))
-                ) {
-                    noIndexDepth = 0;
-                    break;
-                }
+    void flush(bool all) {
+        size_t length = text.size();
+        if (!all) {
+            while (length > 0 && !isspace((unsigned char)text[length-1]))
+                --length;
+            // One enormous word; nothing better to do than to split it.
+            if (length == 0)
+                length = text.size();
+        }
+        if (length > 0 && positions)
+            termGenerator.index_text(Utf8Iterator(text.data(), length));
+        else if (length > 0)
+            termGenerator.index_text_without_positions(Utf8Iterator(text.data(), length));
+        text.erase(0, length);
+    }
+
+    void copyUpTo(size_t place) {
+        if (noIndexDepth == -1) {
+            while (lastCopied < place) {
+                size_t length = min(place - lastCopied, TEXT_BUFFER_SIZE);
+                text.append(&buffer[lastCopied], length);
+                lastCopied += length;
+                if (text.size() >= TEXT_BUFFER_SIZE)
+                    flush(false);
             }
         }
+        lastCopied = place;
     }
 
-    void startOpenTag(const char* tag, int tagLength, int start) {
-        if (noIndexDepth == -1)
-            copyUpTo(start);
-        else
-            ++noIndexDepth;
+    // Tags break words; only once we know it really was a tag, though.
+    void separate() {
+        if (tagNoIndexDepth == -1)
+            text.push_back(' ');
     }
 
-    void finishOpenTag() {
-        lastCopied = offset+1;
+    static bool hasClass(const char* attrValue, int attrValueLength, const char* name) {
+        int strLength = strlen(name);
+        for (int i = 0; i < attrValueLength - strLength + 1; ++i) {
+            if (strncmp(&attrValue[i], name, strLength) == 0 &&
+                (i == attrValueLength - strLength || isspace((unsigned char)attrValue[i+strLength])) &&
+                (i == 0 || isspace((unsigned char)attrValue[i-1]))
+            )
+                return true;
+        }
+        return false;
+    }
+
+    static bool isVoidElement(const char* tag, size_t tagLength) {
+        static const char* elements[] = { "area", "base", "br", "col", "embed", "hr", "img", "input", "link", "meta", "param", "source", "track", "wbr" };
+        for (const char* element : elements) {
+            if (strlen(element) == tagLength && strncasecmp(tag, element, tagLength) == 0)
+                return true;
+        }
+        return false;
+    }
+
+    void attr(const char* attrName, int attrNameLength, const char* attrValue, int attrValueLength) {
+        if (attrNameLength == 5 && strncasecmp(attrName, "class", 5) == 0 && hasClass(attrValue, attrValueLength, "nointernalindex"))
+            tagNoIndex = true;
     }
 
-    void startCloseTag(const char* tag, int tagLength, int start) {
-        if (noIndexDepth == -1)
-            copyUpTo(start);
+    void startTag(size_t start) {
+        copyUpTo(start);
+        tagStart = start;
+        tagNoIndexDepth = noIndexDepth;
+        tagNoIndex = false;
+        tagNameStart = -1;
+        tagNameEnd = -1;
+        attrNameStart = -1;
+        attrNameEnd = -1;
+        attrValueStart = -1;
+        tagState = ETagParsingState::TAG;
+    }
+
+    void finishAttr() {
+        long attrValueEnd = offset;
+        if (attrValueEnd - attrValueStart >= 2 && (buffer[attrValueStart] == '"' || buffer[attrValueStart] == '\'') && buffer[attrValueEnd-1] == buffer[attrValueStart]) {
+            ++attrValueStart;
+            --attrValueEnd;
+        }
+        attr(&buffer[attrNameStart], attrNameEnd - attrNameStart, &buffer[attrValueStart], attrValueEnd - attrValueStart);
+        attrNameStart = -1;
+        attrNameEnd = -1;
+        attrValueStart = -1;
+    }
+
+    void finishOpenTag(const char* tag, size_t tagLength) {
+        separate();
+        lastCopied = offset+1;
+        tagState = ETagParsingState::OPEN;
+        if (buffer[offset-1] == '/' || isVoidElement(tag, tagLength))
+            return;
+        if (noIndexDepth >= 0)
+            ++noIndexDepth;
+        else if (tagNoIndex)
+            noIndexDepth = 0;
+        if ((tagLength == 6 && strncasecmp(tag, "script", 6) == 0) || (tagLength == 5 && strncasecmp(tag, "style", 5) == 0)) {
+            rawTag = tagLength == 6 ? "script" : "style";
+            rawTagLength = tagLength;
+            tagState = ETagParsingState::SCRIPT;
+        }
     }
 
     void finishCloseTag() {
+        separate();
         lastCopied = offset+1;
+        tagState = ETagParsingState::OPEN;
         if (noIndexDepth >= 0)
             --noIndexDepth;
     }
 
-    string parse(const char* buffer, size_t size) {
-        int tagStart;
+    static size_t find(const char* buffer, size_t offset, size_t size, char ch) {
+        const char* next = (const char*)memchr(&buffer[offset], ch, size - offset);
+        return next ? next - buffer : size;
+    }
+
+    // Jumps straight to the next byte that could change our state; most of a document is text, attribute values or script,
+    // where we're only waiting on one or two specific characters. Single characters go through memchr, which is already
+    // vectorized by libc.
+    size_t skip(size_t offset, size_t size) const {
+        switch (strState) {
+            case EStringParsingState::SINGLE:
+                return find(buffer, offset, size, '\'');
+            case EStringParsingState::DOUBLE:
+                return find(buffer, offset, size, '"');
+            case EStringParsingState::OPEN:
+                switch (tagState) {
+                    case ETagParsingState::OPEN:
+                    case ETagParsingState::SCRIPT:
+                        return find(buffer, offset, size, '<');
+                    case ETagParsingState::TAG:
+                        // In the middle of a tag name, or an attribute name or value; nothing but a delimiter matters.
+                        if (tagNameStart != -1 && (tagNameEnd == -1 || (attrNameStart != -1 && attrValueStart != AWAITING_VALUE && !(attrValueStart == -1 && attrNameEnd != -1))))
+                            return TagScanner::find(&buffer[offset], &buffer[size]) - buffer;
+                    break;
+                }
+            break;
+        }
+        return offset;
+    }
+
+    void process(const char* buffer, size_t size) {
         this->buffer = buffer;
-        result.reserve(size);
-        strState = EStringParsingState::OPEN;
-        tagState = ETagParsingState::OPEN;
         lastCopied = 0;
-        noIndexDepth = -1;
-        int attrNameStart;
-        int attrNameEnd;
-        int attrValueStart;
-        int tagNameStart;
-        bool openTag;
-        for (offset = 0; offset < size; ++offset) {
+        for (offset = 0; (offset = skip(offset, size)) < size; ++offset) {
             char ch = buffer[offset];
             switch (strState) {
                 case EStringParsingState::OPEN:
                     switch (tagState) {
                         case ETagParsingState::OPEN:
-                            if (ch == '<') {
-                                tagStart = offset;
-                                attrNameStart = -1;
-                                attrValueStart = -1;
-                                tagNameStart = -1;
-                                tagState = ETagParsingState::TAG;
-                                openTag = true;
-                            }
+                            // A '<' that can't start a tag is just text.
+                            if (ch == '<' && (offset + 1 == size || isalpha((unsigned char)buffer[offset+1]) || buffer[offset+1] == '/' || buffer[offset+1] == '!' || buffer[offset+1] == '?'))
+                                startTag(offset);
                         break;
                         case ETagParsingState::SCRIPT:
-                            if (offset < size - 9 && strncmp(&buffer[offset], "</script>", 9) == 0) {
-                                startCloseTag(&buffer[offset+2], 6, offset);
-                                tagState = ETagParsingState::OPEN;
-                                finishCloseTag();
+                            if (ch == '<' && offset + rawTagLength + 2 <= size && buffer[offset+1] == '/' && strncasecmp(&buffer[offset+2], rawTag, rawTagLength) == 0) {
+                                lastCopied = offset;
+                                startTag(offset);
                             }
                         break;
                         case ETagParsingState::TAG:
                             switch (ch) {
                                 case '=':
-                                    if (attrNameStart != -1) {
-                                        attrNameEnd = offset;
-                                        attrValueStart = offset+1;
+                                    if (attrNameStart != -1 && attrValueStart == -1) {
+                                        if (attrNameEnd == -1)
+                                            attrNameEnd = offset;
+                                        attrValueStart = AWAITING_VALUE;
                                     }
                                 break;
                                 case '\'':
-                                    strState = EStringParsingState::SINGLE;
-                                break;
                                 case '"':
-                                    strState = EStringParsingState::DOUBLE;
+                                    if (attrValueStart == AWAITING_VALUE)
+                                        attrValueStart = offset;
+                                    strState = ch == '"' ? EStringParsingState::DOUBLE : EStringParsingState::SINGLE;
                                 break;
                                 case '>':
                                 case '\t':
                                 case '\n':
+                                case '\r':
+                                case '\f':
                                 case ' ':
-                                    if (attrNameStart == -1) {
-                                        if (tagNameStart != -1) {
-                                            if (buffer[tagStart+1] != '/')
-                                                startOpenTag(&buffer[tagNameStart], offset - tagNameStart, tagStart);
-                                            else
-                                                startCloseTag(&buffer[tagNameStart], offset - tagNameStart, tagStart);
-                                            openTag = false;
-                                        }
-                                    } else {
-                                        int attrValueEnd;
-                                        for (; buffer[attrValueStart] == '"' || buffer[attrValueStart] == '\''; ++attrValueStart);
-                                        for (attrValueEnd = offset-1; buffer[attrValueEnd] == '"' || buffer[attrValueEnd] == '\''; --attrValueEnd);
-                                        attr(&buffer[attrNameStart], attrNameEnd - attrNameStart, &buffer[attrValueStart], attrValueEnd - attrValueStart + 1);
+                                    if (tagNameStart != -1 && tagNameEnd == -1) {
+                                        tagNameEnd = offset;
+                                    } else if (attrNameStart != -1) {
+                                        if (attrValueStart >= 0)
+                                            finishAttr();
+                                        else if (attrNameEnd == -1)
+                                            attrNameEnd = offset;
                                     }
                                     if (ch == '>') {
-                                        if (buffer[tagStart+1] == '/') {
+                                        if (buffer[tagStart+1] == '/')
                                             finishCloseTag();
-                                            tagState = ETagParsingState::OPEN;
-                                        } else {
-                                            finishOpenTag();
-                                            if (strncmp(&buffer[tagNameStart], "script", 6) == 0) {
-                                                tagState = ETagParsingState::SCRIPT;
-                                            } else {
-                                                tagState = ETagParsingState::OPEN;
-                                            }
-                                        }
+                                        else if (tagNameStart != -1)
+                                            finishOpenTag(&buffer[tagNameStart], tagNameEnd - tagNameStart);
+                                        else
+                                            finishOpenTag("", 0);
                                     }
                                 break;
+                                case '/':
+                                    if (offset == tagStart + 1)
+                                        break;
+                                    if (tagNameStart != -1 && tagNameEnd == -1) {
+                                        tagNameEnd = offset;
+                                        break;
+                                    }
+                                    // fallthrough
                                 default:
                                     if (tagNameStart == -1) {
                                         tagNameStart = offset;
-                                    } else if (!openTag && attrNameStart == -1) {
-                                        attrNameStart = offset;
+                                    } else if (tagNameEnd != -1) {
+                                        if (attrValueStart == AWAITING_VALUE) {
+                                            attrValueStart = offset;
+                                        } else if (attrNameStart == -1 || (attrValueStart == -1 && attrNameEnd != -1)) {
+                                            attrNameStart = offset;
+                                            attrNameEnd = -1;
+                                            attrValueStart = -1;
+                                        }
                                     }
                                 break;
                             }
@@ -318,9 +733,8 @@ struct HTMLParser {
                     }
                 break;
                 case EStringParsingState::SINGLE:
-                    if (buffer[offset-1] != '\\' && ch == '\'') {
+                    if (buffer[offset-1] != '\\' && ch == '\'')
                         strState = EStringParsingState::OPEN;
-                    }
                 break;
                 case EStringParsingState::DOUBLE:
                     if (buffer[offset-1] != '\\' && ch == '"')
@@ -328,76 +742,357 @@ struct HTMLParser {
                 break;
             }
         }
-        copyUpTo();
-        return move(result);
+        // A tag that's never closed, or a script that never ends, runs to the end of the document; neither has any text worth indexing.
+        if (tagState == ETagParsingState::OPEN)
+            copyUpTo(size);
+    }
+
+    void parse(const char* buffer, size_t size) {
+        process(buffer, size);
+        flush(true);
     }
 };
 
-bool xapian_index_file(WritableDatabase& database, TermGenerator& termGenerator, const string& path) {
-    Document document;
-    termGenerator.set_document(document);
+// Keeps track of what was indexed on the last build, so that a rebuild only has to touch files that have actually changed.
+// Stored as a plain text file next to the index; one line per file, with the path last so that it can contain spaces.
+struct Manifest {
+    struct Entry {
+        long long mtime;
+        long long size;
+        uint64_t hash;
+        bool seen;
+    };
 
-    FILE* file = fopen(path.data(), "rb");
-    if (!file)
-        throw CoreException("Can't open file %s.", path.data());
-    fseek(file, 0, SEEK_END);
-    size_t size = ftell(file);
-    fseek(file, 0, SEEK_SET);
-    string buffer;
-    buffer.resize(size);
-    if (fread(const_cast<char*>(buffer.data()), sizeof(char), size, file) != size) {
-        throw "Can't read whole file.";
+    string header;
+    unordered_map<string, Entry> entries;
+
+    // Anything that changes how every document is indexed goes in the header, so that changing it forces a full rebuild.
+    Manifest(const char* language, bool bodyPositions) {
+        header = string("nginx-xapian-manifest 2 ") + language + (bodyPositions ? "" : " nopositions");
     }
 
-    // Rather than using libXML2, just pump these into a regex, and print out the JSON. If it gets more complicated, start using libraries, but for now, this should do.
-    SearchResult result;
-    result.path = path;
-    result.description = extract_meta_attribute(buffer, "description");
-    string keywords = extract_meta_attribute(buffer, "keywords");
-    string robots = extract_meta_attribute(buffer, "robot");
-    string language = extract_meta_attribute(buffer, "language");
-    result.url = extract_link_attribute(buffer, "canonical");
-    static auto titleRegex = regex("<\\s*title\\s*>");
-    smatch match;
-    if (regex_search(buffer, match, titleRegex)) {
-        for (unsigned int i = match.position(); i < buffer.size(); ++i) {
-            if (strncmp(&buffer[i], "</title>", sizeof("</title>")-1) == 0) {
-                unsigned int initial = match.position(0) + match.length(0);
-                result.title = string(&buffer[initial], min((int)(i - initial), 1024));
-                break;
+    bool load(const string& path) {
+        FILE* file = fopen(path.data(), "rb");
+        if (!file)
+            return false;
+        char line[PATH_MAX + 128];
+        if (!fgets(line, sizeof(line), file) || strncmp(line, header.data(), header.size()) != 0 || line[header.size()] != '\n') {
+            fclose(file);
+            return false;
+        }
+        while (fgets(line, sizeof(line), file)) {
+            Entry entry = { 0, 0, 0, false };
+            int pathOffset;
+            unsigned long long hash;
+            if (sscanf(line, "%lld %lld %llx %n", &entry.mtime, &entry.size, &hash, &pathOffset) != 3)
+                continue;
+            entry.hash = hash;
+            size_t length = strlen(&line[pathOffset]);
+            if (length > 0 && line[pathOffset+length-1] == '\n')
+                --length;
+            entries[string(&line[pathOffset], length)] = entry;
+        }
+        fclose(file);
+        return true;
+    }
+
+    void save(const string& path) const {
+        string temporaryPath = path + ".tmp";
+        FILE* file = fopen(temporaryPath.data(), "wb");
+        if (!file)
+            throw CoreException("Can't write manifest %s.", temporaryPath.data());
+        fprintf(file, "%s\n", header.data());
+        for (auto& it : entries)
+            fprintf(file, "%lld %lld %llx %s\n", it.second.mtime, it.second.size, (unsigned long long)it.second.hash, it.first.data());
+        if (fclose(file) != 0 || rename(temporaryPath.data(), path.data()) != 0)
+            throw CoreException("Can't write manifest %s.", path.data());
+    }
+
+    // FNV-1a; only used to tell whether a touched file has actually changed, so doesn't need to be anything stronger.
+    static uint64_t hash(const char* buffer, size_t size) {
+        uint64_t hash = 14695981039346656037ULL;
+        for (size_t i = 0; i < size; ++i) {
+            hash ^= (unsigned char)buffer[i];
+            hash *= 1099511628211ULL;
+        }
+        return hash;
+    }
+};
+
+// Simple bounded blocking queue between the stages of the indexing pipeline. Closing the queue wakes everyone up; producers
+// stop being able to push, and consumers drain whatever is left.
+template <class T>
+struct WorkQueue {
+    mutex lock;
+    condition_variable notEmpty;
+    condition_variable notFull;
+    deque<T> items;
+    size_t capacity;
+    bool closed;
+
+    WorkQueue(size_t capacity) : capacity(capacity), closed(false) { }
+
+    bool push(T&& item) {
+        unique_lock<mutex> guard(lock);
+        notFull.wait(guard, [this]{ return closed || items.size() < capacity; });
+        if (closed)
+            return false;
+        items.push_back(move(item));
+        notEmpty.notify_one();
+        return true;
+    }
+
+    bool pop(T& item) {
+        unique_lock<mutex> guard(lock);
+        notEmpty.wait(guard, [this]{ return closed || !items.empty(); });
+        if (items.empty())
+            return false;
+        item = move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    // Takes everything currently queued in one go, so the consumer only has to take the lock once per batch.
+    bool popAll(vector<T>& batch) {
+        unique_lock<mutex> guard(lock);
+        notEmpty.wait(guard, [this]{ return closed || !items.empty(); });
+        if (items.empty())
+            return false;
+        batch.clear();
+        for (auto& item : items)
+            batch.push_back(move(item));
+        items.clear();
+        notFull.notify_all();
+        return true;
+    }
+
+    void close() {
+        unique_lock<mutex> guard(lock);
+        closed = true;
+        notEmpty.notify_all();
+        notFull.notify_all();
+    }
+};
+
+// An entire file, handed straight to the scanners. Small files, which is nearly all of them, are read into a buffer that's reused from
+// one file to the next. Larger ones are mapped rather than copied. Reading a mapping past the end of a file that's been truncated in the
+// meantime raises SIGBUS, so the size is checked again once the file's mapped, and a file that's shrunk is read instead; that only leaves
+// a truncation in the moment between the check and the read, which a deploy that replaces files by renaming new ones over them never causes.
+struct SourceFile {
+    static constexpr size_t MAP_THRESHOLD = 1024*1024;
+
+    const char* data;
+    size_t size;
+    void* mapped;
+
+    SourceFile(const char* path, string& buffer) : data(""), size(0), mapped(nullptr) {
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd == -1 && errno == ENOENT)
+            throw MissingFileException(path);
+        if (fd == -1)
+            throw CoreException("Can't open file %s.", path);
+        struct stat status;
+        if (fstat(fd, &status) != 0) {
+            close(fd);
+            throw CoreException("Can't stat file %s.", path);
+        }
+        if ((size_t)status.st_size >= MAP_THRESHOLD) {
+            void* address = mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (address != MAP_FAILED) {
+                struct stat current;
+                if (fstat(fd, &current) == 0 && current.st_size == status.st_size) {
+                    close(fd);
+                    madvise(address, status.st_size, MADV_SEQUENTIAL);
+                    mapped = address;
+                    data = (const char*)address;
+                    size = status.st_size;
+                    return;
+                }
+                munmap(address, status.st_size);
+            }
+        }
+        // One more byte than it should need, to notice a file that's grown since.
+        size_t length = 0;
+        buffer.resize(max((size_t)status.st_size, (size_t)4096) + 1);
+        while (true) {
+            ssize_t count = read(fd, &buffer[length], buffer.size() - length);
+            if (count == -1 && errno == EINTR)
+                continue;
+            if (count == -1) {
+                close(fd);
+                throw CoreException("Can't read file %s.", path);
             }
+            if (count == 0)
+                break;
+            length += count;
+            if (length == buffer.size())
+                buffer.resize(buffer.size() * 2);
         }
+        close(fd);
+        data = buffer.data();
+        size = length;
     }
 
-    if (result.title.empty() || result.description.empty() || robots.find("nointernalindex") != string::npos)
-        return false;
+    ~SourceFile() {
+        if (mapped)
+            munmap(mapped, size);
+    }
+
+    SourceFile(const SourceFile&) = delete;
+    SourceFile& operator=(const SourceFile&) = delete;
+};
+
+struct IndexJob {
+    string path;
+    // Owned by the manifest; only ever touched by the worker processing this job.
+    Manifest::Entry* entry;
+    long long mtime;
+    long long size;
+    bool known;
+};
+
+struct IndexResult {
+    enum class EAction {
+        NONE,
+        REPLACE,
+        DELETE
+    };
+    EAction action;
+    string path;
+    Document document;
+    // Roughly what the writer will hold on to for this until its next commit.
+    size_t cost;
+};
+
+// Documents are tagged with their language as a boolean term, "L" followed by the name of its stemmer, so that "en", "en-GB" and "english"
+// all end up the same; a language Xapian has no stemmer for is tagged with its code as given. Nothing real is longer than the longest
+// stemmer name, so anything that is comes back empty, and is treated as the default language, rather than making an oversized term.
+static constexpr size_t MAX_LANGUAGE_CODE = 16;
+
+static string xapian_language_code(const char* language, size_t length) {
+    string code;
+    for (size_t i = 0; i < length && language[i] != '-' && language[i] != '_' && language[i] != ','; ++i) {
+        if (!isspace((unsigned char)language[i]))
+            code.push_back(tolower((unsigned char)language[i]));
+        if (code.size() > MAX_LANGUAGE_CODE)
+            return string();
+    }
+    return code;
+}
+
+static string xapian_language_term(const Stem& stem, const string& code) {
+    string description = stem.get_description();
+    size_t open = description.find('('), close = description.rfind(')');
+    return "L" + (open != string::npos && close != string::npos && close > open + 1 ? description.substr(open + 1, close - open - 1) : code);
+}
+
+// Each indexing worker's stemmers, by language; a document in a language with no stemmer (or none at all) is stemmed in the index's own.
+struct Stemmers {
+    struct Language {
+        Stem stem;
+        string term;
+    };
+    Language fallback;
+    unordered_map<string, Language> languages;
+
+    Stemmers(const char* language) {
+        fallback.stem = Stem(language);
+        fallback.term = xapian_language_term(fallback.stem, xapian_language_code(language, strlen(language)));
+    }
 
+    const Language& get(const string& language) {
+        string code = xapian_language_code(language.data(), language.size());
+        if (code.empty())
+            return fallback;
+        auto it = languages.find(code);
+        if (it != languages.end())
+            return it->second;
+        Language entry;
+        try {
+            entry.stem = Stem(code);
+            entry.term = xapian_language_term(entry.stem, code);
+        } catch (InvalidArgumentError& e) {
+            entry.stem = fallback.stem;
+            entry.term = "L" + code;
+        }
+        return languages.emplace(code, move(entry)).first->second;
+    }
+};
+
+// Everything a worker needs to index a file, kept from one file to the next and cleared in between; once a worker's seen a few files,
+// its buffers are big enough, and indexing another allocates little more than the document itself.
+struct IndexContext {
+    TermGenerator termGenerator;
+    Stemmers stemmers;
+    SearchResult result;
+    HeadScanner head;
+    HTMLParser parser;
+    string contents;
+    string data;
+
+    IndexContext(const char* language, bool bodyPositions) : stemmers(language), parser(termGenerator, bodyPositions) { }
+
+    void reset() {
+        result.clear();
+        head.clear();
+        parser.reset();
+    }
+};
+
+IndexResult::EAction xapian_index_file(IndexContext& context, IndexJob& job, Document& document) {
+    const string& path = job.path;
+    TermGenerator& termGenerator = context.termGenerator;
+    termGenerator.set_document(document);
+
+    SourceFile file(path.data(), context.contents);
+
+    uint64_t hash = Manifest::hash(file.data, file.size);
+    job.entry->mtime = job.mtime;
+    job.entry->size = job.size;
+    if (job.known && job.entry->hash == hash)
+        return IndexResult::EAction::NONE;
+    job.entry->hash = hash;
+
+    context.reset();
+    SearchResult& result = context.result;
+    HeadScanner& head = context.head;
+    result.path = path;
+    head.scan(file.data, file.size, result);
 
-    termGenerator.index_text(result.title.data(), 10);
+    // The file may have been indexed on a previous build, and has since been changed to no longer be indexable.
+    if (result.title.empty() || result.description.empty() || head.robots.find("nointernalindex") != string::npos)
+        return job.known ? IndexResult::EAction::DELETE : IndexResult::EAction::NONE;
+
+    const Stemmers::Language& language = context.stemmers.get(head.language);
+    termGenerator.set_stemmer(language.stem);
+
+    termGenerator.index_text(result.title, 10);
     termGenerator.increase_termpos();
-    termGenerator.index_text(keywords.data(), 3);
+    termGenerator.index_text(head.keywords, 3);
     termGenerator.increase_termpos();
-    termGenerator.index_text(result.description.data(), 3);
+    termGenerator.index_text(result.description, 3);
     termGenerator.increase_termpos();
 
-    HTMLParser parser;
-    string text = parser.parse(buffer.data(), buffer.size());
-
-    termGenerator.index_text(text.c_str());
+    context.parser.parse(file.data, file.size);
     termGenerator.increase_termpos();
 
-    document.set_data(result.pack());
+    result.pack(context.data);
+    document.set_data(context.data);
     document.add_boolean_term(path);
-    database.replace_document(path, document);
-    return true;
+    document.add_boolean_term(language.term);
+    return IndexResult::EAction::REPLACE;
 }
 
-void xapian_traverse_index_directories(WritableDatabase& database, TermGenerator& termGenerator, const char* directory, regex* reg) {
+// Walks the tree on the calling thread, and hands off anything that the manifest can't prove is unchanged to the workers.
+// Returns false if the pipeline was shut down underneath us.
+bool xapian_traverse_index_directories(WorkQueue<IndexJob>& jobs, Manifest& manifest, const char* directory, regex* reg, atomic<size_t>& skipped) {
     DIR *dir = opendir(directory);
     if (!dir)
-        return;
+        return true;
     dirent *dp;
-    while ((dp = readdir (dir)) != NULL) {
+    bool running = true;
+    while (running && (dp = readdir (dir)) != NULL) {
         char path[PATH_MAX];
         switch (dp->d_type) {
             case DT_DIR: {
@@ -405,116 +1100,928 @@ void xapian_traverse_index_directories(WritableDatabase& database, TermGenerator
                     strcpy(path, directory);
                     strcat(path, "/");
                     strcat(path, dp->d_name);
-                    xapian_traverse_index_directories(database, termGenerator, path, reg);
+                    running = xapian_traverse_index_directories(jobs, manifest, path, reg, skipped);
                 }
             } break;
-            case DT_REG:
-                if (strncmp(&dp->d_name[strlen(dp->d_name)-5], ".html", 5) == 0) {
+            case DT_REG: {
+                size_t length = strlen(dp->d_name);
+                if (length >= 5 && strncmp(&dp->d_name[length-5], ".html", 5) == 0) {
                     strcpy(path, directory);
                     strcat(path, "/");
                     strcat(path, dp->d_name);
-                    if (!reg || regex_search(path, *reg))
-                        xapian_index_file(database, termGenerator, path);
+                    if (reg && !regex_search(path, *reg))
+                        break;
+                    struct stat status;
+                    if (stat(path, &status) != 0) {
+                        if (errno != ENOENT)
+                            throw CoreException("Can't stat file %s.", path);
+                        // Left unseen, so that anything indexed from it before is dropped.
+                        ++skipped;
+                        break;
+                    }
+                    long long mtime = (long long)status.st_mtim.tv_sec * 1000000000LL + status.st_mtim.tv_nsec;
+                    auto it = manifest.entries.find(path);
+                    bool known = it != manifest.entries.end();
+                    Manifest::Entry& entry = known ? it->second : manifest.entries[path];
+                    entry.seen = true;
+                    if (!known || entry.mtime != mtime || entry.size != (long long)status.st_size)
+                        running = jobs.push({ path, &entry, mtime, (long long)status.st_size, known });
                 }
-            break;
+            } break;
         }
     }
+    closedir(dir);
+    return running;
 }
 
-int ngx_xapian_build_index(const char* directory, const char* language, const char* target, const char* reg) {
-    try {
-        WritableDatabase database(target, DB_CREATE_OR_OVERWRITE);
-        TermGenerator termGenerator;
-        termGenerator.set_stemmer(Stem(language));
-        if (reg) {
-            auto compiledRegex = regex(reg);
-            xapian_traverse_index_directories(database, termGenerator, directory, &compiledRegex);
-        } else {
-            xapian_traverse_index_directories(database, termGenerator, directory, nullptr);
-        }
-    } catch (Xapian::Error& e) {
-        ngx_xapian_set_error(e.get_msg().data());
-        return -1;
-    } catch (std::exception& e) {
-        ngx_xapian_set_error(e.what());
-        return -1;
-    } catch (...) {
-        ngx_xapian_set_error("Unknown error");
-        return -1;
-    }
-    return 0;
-}
+struct IndexPipeline {
+    WritableDatabase& database;
+    const char* language;
+    const ngx_xapian_build_options_t& options;
+    WorkQueue<IndexJob> jobs;
+    WorkQueue<IndexResult> results;
+    mutex errorLock;
+    string error;
+    // Files that disappeared partway through the build.
+    atomic<size_t> skipped;
+    // Files that the manifest couldn't prove were unchanged; most often, they turn out to have just been touched.
+    atomic<size_t> examined;
+    // Documents actually replaced or deleted; if there were none, there's nothing new to publish.
+    size_t written;
 
-int ngx_xapian_search_index(const char* index, const char* language, const char* query, int max_results, ngx_xapian_result_callbackp resultCallback, void* data) {
-    int total = -1;
-    try {
-        Database database(index);
-        QueryParser queryParser;
-        queryParser.set_stemmer(Stem(language));
-        queryParser.set_stemming_strategy(QueryParser::STEM_SOME);
+    IndexPipeline(WritableDatabase& database, const char* language, const ngx_xapian_build_options_t& options, int workers) : database(database), language(language), options(options), jobs(workers * 16), results(workers * 16), skipped(0), examined(0), written(0) { }
 
-        auto parsedQuery = queryParser.parse_query(query);
-        Enquire inquiry(database);
-        inquiry.set_query(parsedQuery);
-        MSet docset = inquiry.get_mset(0, max_results);
+    void fail(const char* message) {
+        {
+            unique_lock<mutex> guard(errorLock);
+            if (error.empty())
+                error = message;
+        }
+        jobs.close();
+        results.close();
+    }
 
-        total = 0;
-        for (MSet::iterator it = docset.begin(); it != docset.end(); ++it) {
-            auto str = it.get_document().get_data();
-            resultCallback({ str.data(), str.size() }, data);
-            ++total;
+    // Stops the pipeline on the first failure; the error is rethrown on the calling thread once everything has been joined.
+    template <class T>
+    void guard(T func) {
+        try {
+            func();
+        } catch (Xapian::Error& e) {
+            fail(e.get_msg().data());
+        } catch (std::exception& e) {
+            fail(e.what());
+        } catch (const char* e) {
+            fail(e);
+        } catch (...) {
+            fail("Unknown error");
         }
-    } catch (Xapian::Error& e) {
-        ngx_xapian_set_error(e.get_msg().data());
-        return -1;
-    } catch (std::exception& e) {
-        ngx_xapian_set_error(e.what());
-        return -1;
-    } catch (...) {
-        ngx_xapian_set_error("Unknown error");
-        return -1;
     }
-    return total;
-}
-
-int copyToJson(char* dst, const char* str, int len) {
-    char* target = dst;
-    for (int i = 0; i < len; ++i) {
-        if (str[i] == '"' && (i == 0 || str[i-1] != '\\'))
-            *(target++) = '\\';
-        *(target++) = str[i];
-    }
-    return target - dst;
-}
-int copyToJsonField(char* dst, const char* name, const char* str, int len) {
-    char* target = dst;
-    int name_length = strlen(name);
-    *(target++) = '"';
-    target = (char*)memcpy(target, name, name_length) + name_length;
-    *(target++) = '"';
-    *(target++) = ':';
-    *(target++) = '"';
-    target += copyToJson(target, str, len);
-    *(target++) = '"';
-    return target - dst;
-};
 
-Liquid::Context& ngx_xapian_get_liquid_context() {
-    static bool init = false;
+    void work() {
+        guard([this]{
+            IndexContext context(language, options.body_positions);
+            IndexJob job;
+            while (jobs.pop(job)) {
+                ++examined;
+                Document document;
+                IndexResult::EAction action;
+                try {
+                    action = xapian_index_file(context, job, document);
+                } catch (MissingFileException& e) {
+                    // Treated as if it had never been seen; if it was indexed before, it's deleted once the walk is done.
+                    job.entry->seen = false;
+                    ++skipped;
+                    continue;
+                }
+                if (action == IndexResult::EAction::NONE)
+                    continue;
+                // Its data, and a buffered posting per term; Xapian keeps a little more than this, so the budget's a guide, rather than a hard limit.
+                size_t cost = job.path.size() + document.get_data().size() + (size_t)document.termlist_count() * 64;
+                if (!results.push({ action, move(job.path), move(document), cost }))
+                    break;
+            }
+        });
+    }
+
+    // Changes are made inside a transaction, so that Xapian never flushes of its own accord; instead, they're committed every so many
+    // documents, or once they've taken up the memory budget, whichever comes first, and otherwise only once the whole build's done.
+    void write() {
+        guard([this]{
+            vector<IndexResult> batch;
+            size_t pending = 0, pendingCost = 0;
+            database.begin_transaction(false);
+            while (results.popAll(batch)) {
+                for (auto& result : batch) {
+                    if (result.action == IndexResult::EAction::REPLACE)
+                        database.replace_document(result.path, result.document);
+                    else
+                        database.delete_document(result.path);
+                    ++pending;
+                    ++written;
+                    pendingCost += result.cost;
+                    if ((options.docs_per_commit > 0 && pending >= (size_t)options.docs_per_commit) || (options.memory_budget > 0 && pendingCost >= options.memory_budget)) {
+                        database.commit_transaction();
+                        database.commit();
+                        database.begin_transaction(false);
+                        pending = pendingCost = 0;
+                    }
+                }
+            }
+            database.commit_transaction();
+        });
+    }
+
+    void run(Manifest& manifest, const char* directory, regex* reg, int workerCount) {
+        thread writer([this]{ write(); });
+        vector<thread> workers;
+        for (int i = 0; i < workerCount; ++i)
+            workers.emplace_back([this]{ work(); });
+        guard([&]{ xapian_traverse_index_directories(jobs, manifest, directory, reg, skipped); });
+        jobs.close();
+        for (auto& worker : workers)
+            worker.join();
+        results.close();
+        writer.join();
+        if (!error.empty())
+            throw CoreException("%s", error.data());
+    }
+};
+
+// Serializes builds of the same index across processes; a build started by a reload waits for one that's still running, and then
+// only has to pick up whatever changed in the meantime.
+struct BuildLock {
+    int fd;
+
+    BuildLock(const string& path) {
+        fd = open(path.data(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd == -1)
+            throw CoreException("Can't open lock file %s.", path.data());
+        while (flock(fd, LOCK_EX) != 0) {
+            if (errno != EINTR) {
+                close(fd);
+                throw CoreException("Can't lock %s.", path.data());
+            }
+        }
+    }
+
+    ~BuildLock() {
+        close(fd);
+    }
+};
+
+// Each build is written to a fresh generation directory next to the index, holding the database and its manifest, and only becomes
+// visible once it's complete, by atomically repointing the index path (a symlink) at it. Readers hold a shared lock on the generation
+// they're using, so an old generation is only deleted once nothing has it open any more.
+struct Generations {
+    string target;
+    string directory;
+
+    Generations(const char* target) : target(target), directory(string(target) + ".generations") { }
+
+    string path(long generation) const {
+        return directory + "/" + to_string(generation);
+    }
+
+    static long parse(const char* name) {
+        char* end;
+        long generation = strtol(name, &end, 10);
+        return (end != name && *end == 0 && generation > 0) ? generation : -1;
+    }
+
+    // The published generation, or -1 if nothing has been published yet (or the index predates generations).
+    long current() const {
+        char link[PATH_MAX];
+        ssize_t length = readlink(target.data(), link, sizeof(link)-1);
+        if (length <= 0)
+            return -1;
+        link[length] = 0;
+        char* last = strrchr(link, '/');
+        if (!last)
+            return -1;
+        *last = 0;
+        char* name = strrchr(link, '/');
+        return parse(name ? name + 1 : link);
+    }
+
+    long next() const {
+        long generation = 0;
+        DIR* dir = opendir(directory.data());
+        if (dir) {
+            dirent* dp;
+            while ((dp = readdir(dir)) != NULL)
+                generation = max(generation, parse(dp->d_name));
+            closedir(dir);
+        }
+        return generation + 1;
+    }
+
+    static void remove(const char* path) {
+        nftw(path, +[](const char* path, const struct stat* status, int type, struct FTW* ftw) { return ::remove(path); }, 16, FTW_DEPTH | FTW_PHYS);
+    }
+
+    static void copy(const string& from, const string& to) {
+        DIR* dir = opendir(from.data());
+        if (!dir)
+            throw CoreException("Can't open %s.", from.data());
+        if (mkdir(to.data(), 0755) != 0) {
+            closedir(dir);
+            throw CoreException("Can't create %s.", to.data());
+        }
+        dirent* dp;
+        while ((dp = readdir(dir)) != NULL) {
+            // Xapian's lock file belongs to whoever has the database open for writing; never copy it.
+            if ((dp->d_type != DT_REG && dp->d_type != DT_UNKNOWN) || strcmp(dp->d_name, "flintlock") == 0)
+                continue;
+            string source = from + "/" + dp->d_name, destination = to + "/" + dp->d_name;
+            // Not every filesystem fills in the type.
+            struct stat status;
+            if (dp->d_type == DT_UNKNOWN && (lstat(source.data(), &status) != 0 || !S_ISREG(status.st_mode)))
+                continue;
+            int in = open(source.data(), O_RDONLY | O_CLOEXEC);
+            int out = open(destination.data(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            bool success = in != -1 && out != -1 && fstat(in, &status) == 0;
+            for (off_t offset = 0; success && offset < status.st_size; ) {
+                ssize_t written = sendfile(out, in, &offset, status.st_size - offset);
+                success = written > 0;
+            }
+            if (in != -1)
+                close(in);
+            if (out != -1 && close(out) != 0)
+                success = false;
+            if (!success) {
+                closedir(dir);
+                throw CoreException("Can't copy %s to %s.", source.data(), destination.data());
+            }
+        }
+        closedir(dir);
+    }
+
+    void publish(long generation) const {
+        size_t slash = directory.rfind('/');
+        string link = (slash == string::npos ? directory : directory.substr(slash + 1)) + "/" + to_string(generation) + "/index";
+        string temporary = target + ".tmp";
+        unlink(temporary.data());
+        if (symlink(link.data(), temporary.data()) != 0)
+            throw CoreException("Can't create %s.", temporary.data());
+        // An index built before generations existed is a plain directory, which can't be renamed over; it has to go first.
+        struct stat status;
+        if (lstat(target.data(), &status) == 0 && S_ISDIR(status.st_mode)) {
+            remove(target.data());
+            unlink((target + ".manifest").data());
+        }
+        if (rename(temporary.data(), target.data()) != 0)
+            throw CoreException("Can't publish %s.", target.data());
+    }
+
+    // Deletes a generation, unless a reader, or the build writing it, holds a lock on it.
+    void discard(long generation) const {
+        string path = this->path(generation);
+        int fd = open(path.data(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1)
+            return;
+        if (flock(fd, LOCK_EX | LOCK_NB) == 0)
+            remove(path.data());
+        close(fd);
+    }
+
+    vector<long> list() const {
+        vector<long> generations;
+        DIR* dir = opendir(directory.data());
+        if (!dir)
+            return generations;
+        dirent* dp;
+        while ((dp = readdir(dir)) != NULL) {
+            long generation = parse(dp->d_name);
+            if (generation != -1)
+                generations.push_back(generation);
+        }
+        closedir(dir);
+        return generations;
+    }
+
+    // Deletes every generation older than the published one, other than the given one, that no reader holds a lock on; anything newer
+    // is a build that's still being written. If nothing's published, the caller has to hold the build lock.
+    void collect(long keep) const {
+        long published = current();
+        for (long generation : list()) {
+            if (generation != keep && (published == -1 || generation < published))
+                discard(generation);
+        }
+    }
+
+    // Deletes every generation newer than the published one; only called under the build lock, so they can only have been left behind by
+    // a build that died.
+    void abandon(long published) const {
+        for (long generation : list()) {
+            if (generation > published)
+                discard(generation);
+        }
+    }
+};
+
+// Held by a build on the generation it's writing, from creation until it's published, so that nothing can collect it in the meantime.
+struct GenerationClaim {
+    int fd;
+
+    GenerationClaim(const string& path) {
+        fd = open(path.data(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1)
+            throw CoreException("Can't open %s.", path.data());
+        if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+            close(fd);
+            throw CoreException("Can't lock %s.", path.data());
+        }
+    }
+
+    ~GenerationClaim() {
+        close(fd);
+    }
+};
+
+// A reader's hold on whatever generation is published at the time it's acquired; the database should be opened through path,
+// rather than the index symlink, so that a publish in the meantime can't swap it out from underneath.
+struct GenerationReference {
+    int fd;
+    long generation;
+    string path;
+
+    GenerationReference() : fd(-1), generation(-1) { }
+    GenerationReference(const char* index) : fd(-1), generation(-1) { acquire(index); }
+    ~GenerationReference() { release(); }
+    GenerationReference(const GenerationReference&) = delete;
+    GenerationReference& operator=(const GenerationReference&) = delete;
+
+    void acquire(const char* index) {
+        release();
+        Generations generations(index);
+        // If a new generation's published between reading the link and locking, the one we locked may already have been collected; just try again.
+        for (int attempt = 0; attempt < 8; ++attempt) {
+            generation = generations.current();
+            if (generation == -1)
+                break;
+            string directory = generations.path(generation);
+            fd = open(directory.data(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (fd != -1 && flock(fd, LOCK_SH) == 0 && access((directory + "/index").data(), F_OK) == 0) {
+                path = directory + "/index";
+                return;
+            }
+            release();
+        }
+        generation = -1;
+        path = index;
+    }
+
+    void release() {
+        if (fd != -1)
+            close(fd);
+        fd = -1;
+    }
+};
+
+// Opening a database means reopening its files and starting with a cold block cache, so each process keeps the ones it's searched
+// open. Before each search, checking whether there's something newer costs a readlink (or, for an index that predates generations, a
+// stat), per shard, and only the shards that have changed are reopened.
+struct OpenIndex {
+    // An index built from a single directory is its own only shard; one built from several is a stub database listing them.
+    struct Shard {
+        string index;
+        GenerationReference reference;
+        Database database;
+        struct timespec modified;
+
+        Shard(const string& index) : index(index), modified({ 0, 0 }) {
+            reference.acquire(index.data());
+            database = Database(reference.path);
+            modified = version(reference.path);
+        }
+
+        bool stale() const {
+            if (reference.generation != -1)
+                return Generations(index.data()).current() != reference.generation;
+            struct timespec current = version(index);
+            return current.tv_sec != modified.tv_sec || current.tv_nsec != modified.tv_nsec;
+        }
+
+        void reopen() {
+            database.reopen();
+            modified = version(reference.path);
+        }
+
+        unsigned long long identify() const {
+            struct stat status;
+            if (stat(reference.path.data(), &status) != 0)
+                return 0;
+            unsigned long long identity = ((unsigned long long)status.st_ino << 32) ^ (unsigned long long)reference.generation;
+            return identity ^ ((unsigned long long)modified.tv_sec * 1000000000ULL + modified.tv_nsec) ^ ((unsigned long long)database.get_revision() << 48);
+        }
+    };
+
+    string index;
+    vector<unique_ptr<Shard>> shards;
+    // When the shard list was last written, for an index that has one.
+    struct timespec listed;
+    Database database;
+    bool open;
+    struct timespec modified;
+    // Identifies exactly what's being searched, for anything caching results; a generation number alone isn't enough, as those start
+    // again from 1 if the generations are deleted.
+    unsigned long long revision;
+
+    OpenIndex(const string& index) : index(index), listed({ 0, 0 }), open(false), modified({ 0, 0 }), revision(0) { }
+
+    // When a database was last written; a compacted one is a single file, which is its own version file.
+    static struct timespec version(const string& path) {
+        struct stat status;
+        if (stat((path + "/iamglass").data(), &status) != 0 && stat(path.data(), &status) != 0)
+            return { 0, 0 };
+        return status.st_mtim;
+    }
+
+    static struct timespec listing(const string& path) {
+        struct stat status;
+        if (lstat(path.data(), &status) != 0 || !S_ISREG(status.st_mode))
+            return { 0, 0 };
+        return status.st_mtim;
+    }
+
+    // The shards that make up an index; relative paths in a stub database are relative to the stub itself.
+    static vector<string> list(const string& path) {
+        struct stat status;
+        if (lstat(path.data(), &status) != 0 || !S_ISREG(status.st_mode))
+            return { path };
+        FILE* file = fopen(path.data(), "rb");
+        if (!file)
+            throw CoreException("Can't open %s.", path.data());
+        size_t slash = path.rfind('/');
+        string directory = slash == string::npos ? string() : path.substr(0, slash + 1);
+        vector<string> shards;
+        char line[PATH_MAX + 16];
+        while (fgets(line, sizeof(line), file)) {
+            size_t length = strlen(line);
+            while (length > 0 && (line[length-1] == '\n' || line[length-1] == '\r'))
+                line[--length] = 0;
+            const char* shard = strchr(line, ' ');
+            if (line[0] == '#' || !shard)
+                continue;
+            ++shard;
+            shards.push_back(shard[0] == '/' ? string(shard) : directory + shard);
+        }
+        fclose(file);
+        return shards;
+    }
+
+    bool stale() const {
+        struct timespec current = listing(index);
+        if (current.tv_sec != listed.tv_sec || current.tv_nsec != listed.tv_nsec)
+            return true;
+        for (auto& shard : shards) {
+            if (shard->stale())
+                return true;
+        }
+        return false;
+    }
+
+    Database& get() {
+        if (!open || stale()) {
+            // Everything that has to be opened afresh is opened first; if any of it fails, whatever was open before is left as it was.
+            vector<string> paths = list(index);
+            vector<unique_ptr<Shard>> opened(paths.size());
+            for (size_t i = 0; i < paths.size(); ++i) {
+                auto it = find_if(shards.begin(), shards.end(), [&](const unique_ptr<Shard>& shard) { return shard->index == paths[i]; });
+                if (it == shards.end() || ((*it)->stale() && ((*it)->reference.generation != -1 || Generations(paths[i].data()).current() != -1)))
+                    opened[i].reset(new Shard(paths[i]));
+            }
+            listed = listing(index);
+            vector<unique_ptr<Shard>> previous = move(shards);
+            for (size_t i = 0; i < paths.size(); ++i) {
+                if (!opened[i]) {
+                    auto it = find_if(previous.begin(), previous.end(), [&](const unique_ptr<Shard>& shard) { return shard && shard->index == paths[i]; });
+                    opened[i] = move(*it);
+                    if (opened[i]->stale())
+                        opened[i]->reopen();
+                }
+                shards.push_back(move(opened[i]));
+            }
+            // Combining shards only shares what each of them already has open, so this is cheap enough to redo whenever any of them changes.
+            database = Database();
+            for (auto& shard : shards)
+                database.add_database(shard->database);
+            // Letting go of the generations that were superseded just releases our locks on them; deleting them is left to the builder.
+            previous.clear();
+            identify();
+            open = true;
+        }
+        return database;
+    }
+
+    void reopen() {
+        for (auto& shard : shards)
+            shard->reopen();
+        database.reopen();
+        identify();
+    }
+
+    void identify() {
+        revision = 0;
+        modified = { 0, 0 };
+        for (auto& shard : shards) {
+            revision = ((revision << 7) | (revision >> 57)) ^ shard->identify();
+            if (shard->modified.tv_sec > modified.tv_sec || (shard->modified.tv_sec == modified.tv_sec && shard->modified.tv_nsec > modified.tv_nsec))
+                modified = shard->modified;
+        }
+    }
+};
+
+void ngx_xapian_build_options_init(ngx_xapian_build_options_t* options) {
+    options->threads = 0;
+    options->body_positions = 1;
+    options->compact = 0;
+    options->docs_per_commit = 0;
+    options->memory_budget = 0;
+    options->stats = NULL;
+}
+
+int ngx_xapian_build_index(const char* directory, const char* language, const char* target, const char* reg) {
+    ngx_xapian_build_options_t options;
+    ngx_xapian_build_options_init(&options);
+    return ngx_xapian_build_index_with_options(directory, language, target, reg, &options);
+}
+
+// The space a database takes up on disk; either a directory of tables, or a single file.
+static unsigned long long xapian_database_size(const string& path) {
+    struct stat status;
+    if (stat(path.data(), &status) != 0)
+        return 0;
+    if (!S_ISDIR(status.st_mode))
+        return status.st_size;
+    unsigned long long size = 0;
+    DIR* dir = opendir(path.data());
+    if (!dir)
+        return 0;
+    dirent* dp;
+    while ((dp = readdir(dir)) != NULL) {
+        if (stat((path + "/" + dp->d_name).data(), &status) == 0 && S_ISREG(status.st_mode))
+            size += status.st_size;
+    }
+    closedir(dir);
+    return size;
+}
+
+// Fills in the generation that's just been created, and publishes it if it differs from the one before; returns whether it did.
+static bool xapian_build_generation(const char* directory, const char* language, const char* reg, const ngx_xapian_build_options_t* options, ngx_xapian_build_stats_t& stats, const Generations& generations, long previous, long generation) {
+    string path = generations.path(generation);
+
+    // Only files that have changed since the last build are reindexed, on top of a copy of the previous generation; anything that's
+    // missing from its manifest forces a full rebuild.
+    Manifest manifest(language, options->body_positions);
+    bool incremental = previous != -1 && manifest.load(generations.path(previous) + "/manifest");
+    string previousIndex = generations.path(previous) + "/index";
+    bool compacted = false;
+    if (incremental) {
+        // A compacted generation is a single file, which can't be written to; compacting it back out into tables is about as quick as a copy.
+        struct stat status;
+        compacted = stat(previousIndex.data(), &status) == 0 && !S_ISDIR(status.st_mode);
+        if (compacted)
+            Database(previousIndex).compact(path + "/index", DBCOMPACT_NO_RENUMBER);
+        else
+            Generations::copy(previousIndex, path + "/index");
+    } else {
+        manifest.entries.clear();
+    }
+
+    bool changed = !incremental || compacted != (options->compact != 0), touched = false;
+    {
+        int workers = options->threads > 0 ? options->threads : max((int)thread::hardware_concurrency(), 1);
+        WritableDatabase database(path + "/index", incremental ? DB_OPEN : DB_CREATE_OR_OVERWRITE);
+        IndexPipeline pipeline(database, language, *options, workers);
+        if (reg) {
+            auto compiledRegex = regex(reg);
+            pipeline.run(manifest, directory, &compiledRegex, workers);
+        } else {
+            pipeline.run(manifest, directory, nullptr, workers);
+        }
+        for (auto it = manifest.entries.begin(); it != manifest.entries.end(); ) {
+            if (!it->second.seen) {
+                database.delete_document(it->first);
+                it = manifest.entries.erase(it);
+                changed = true;
+            } else
+                ++it;
+        }
+        database.commit();
+        stats.documents = database.get_doccount();
+        stats.skipped = pipeline.skipped;
+        changed = changed || pipeline.written > 0;
+        touched = pipeline.examined > 0;
+        database.close();
+    }
+    // Nothing's changed since the last build; rather than publishing an identical copy, which would have every reader reopen it, the
+    // current generation stays as it is.
+    if (!changed) {
+        // Files that were looked at again, only to find their contents the same, needn't be next time. Nothing but a build reads the
+        // manifest, and this one holds the build lock, so it can be updated in place.
+        if (touched)
+            manifest.save(generations.path(previous) + "/manifest");
+        Generations::remove(path.data());
+        stats.size = xapian_database_size(previousIndex);
+        stats.compacted_size = compacted ? stats.size : 0;
+        return false;
+    }
+    stats.size = xapian_database_size(path + "/index");
+    stats.compacted_size = 0;
+    // Nothing writes to a published generation, so it may as well be packed into full blocks in a single file; searches touch fewer of
+    // them, and there's only one file to ship elsewhere.
+    if (options->compact) {
+        Database(path + "/index").compact(path + "/index.compact", DBCOMPACT_SINGLE_FILE);
+        Generations::remove((path + "/index").data());
+        if (rename((path + "/index.compact").data(), (path + "/index").data()) != 0)
+            throw CoreException("Can't move %s into place.", (path + "/index.compact").data());
+        stats.compacted_size = xapian_database_size(path + "/index");
+    }
+    manifest.save(path + "/manifest");
+    generations.publish(generation);
+    return true;
+}
+
+static void xapian_build_index(const char* directory, const char* language, const char* target, const char* reg, const ngx_xapian_build_options_t* options, ngx_xapian_build_stats_t& stats) {
+    auto start = chrono::steady_clock::now();
+    BuildLock lock(string(target) + ".lock");
+    Generations generations(target);
+    long previous = generations.current();
+    generations.abandon(previous);
+    long generation = generations.next();
+    string path = generations.path(generation);
+    if (mkdir(generations.directory.data(), 0755) != 0 && errno != EEXIST)
+        throw CoreException("Can't create %s.", generations.directory.data());
+    if (mkdir(path.data(), 0755) != 0)
+        throw CoreException("Can't create %s.", path.data());
+    bool published;
+    {
+        GenerationClaim claim(path);
+        try {
+            published = xapian_build_generation(directory, language, reg, options, stats, generations, previous, generation);
+        } catch (...) {
+            Generations::remove(path.data());
+            throw;
+        }
+    }
+    if (published)
+        generations.collect(generation);
+    stats.milliseconds = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+}
+
+// A shard's named after the directory and regex it's built from, rather than its place in the list, so that the list can be reordered,
+// or added to, without rebuilding the shards already there.
+static string xapian_shard_name(const char* directory, const char* reg) {
+    string source = string(directory) + '\0' + (reg ? reg : "");
+    char name[17];
+    snprintf(name, sizeof(name), "%016llx", (unsigned long long)Manifest::hash(source.data(), source.size()));
+    return name;
+}
+
+// Any shard that isn't in the list is from another configuration, and is dropped, other than generations still being read.
+static void xapian_drop_shards(const string& target, const vector<string>& keep) {
+    string directory = target + ".shards";
+    DIR* dir = opendir(directory.data());
+    if (!dir)
+        return;
+    vector<string> dropped;
+    dirent* dp;
+    while ((dp = readdir(dir)) != NULL) {
+        if (strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0)
+            continue;
+        string name = dp->d_name;
+        for (const char* suffix : { ".generations", ".lock", ".tmp" }) {
+            size_t length = strlen(suffix);
+            if (name.size() > length && name.compare(name.size() - length, length, suffix) == 0) {
+                name.resize(name.size() - length);
+                break;
+            }
+        }
+        if (find(keep.begin(), keep.end(), name) == keep.end() && find(dropped.begin(), dropped.end(), name) == dropped.end())
+            dropped.push_back(name);
+    }
+    closedir(dir);
+    for (auto& name : dropped) {
+        string path = directory + "/" + name;
+        // A build of the shard that's still running elsewhere keeps hold of what it's writing.
+        BuildLock lock(path + ".lock");
+        unlink(path.data());
+        unlink((path + ".tmp").data());
+        Generations(path.data()).collect(-1);
+        rmdir((path + ".generations").data());
+        unlink((path + ".lock").data());
+    }
+}
+
+int ngx_xapian_build_index_with_options(const char* directory, const char* language, const char* target, const char* reg, const ngx_xapian_build_options_t* options) {
+    try {
+        ngx_xapian_build_stats_t stats = { 0, 0, 0, 0, 0 };
+        xapian_build_index(directory, language, target, reg, options, stats);
+        if (options->stats)
+            *options->stats = stats;
+    } catch (Xapian::Error& e) {
+        ngx_xapian_set_error(e.get_msg().data());
+        return -1;
+    } catch (std::exception& e) {
+        ngx_xapian_set_error(e.what());
+        return -1;
+    } catch (...) {
+        ngx_xapian_set_error("Unknown error");
+        return -1;
+    }
+    return 0;
+}
+
+int ngx_xapian_build_shards(const char* const* directories, const char* const* regs, int count, const char* language, const char* target, const ngx_xapian_build_options_t* options) {
+    if (count == 1) {
+        if (ngx_xapian_build_index_with_options(directories[0], language, target, regs ? regs[0] : nullptr, options) != 0)
+            return -1;
+        xapian_drop_shards(target, {});
+        return 0;
+    }
+    try {
+        auto start = chrono::steady_clock::now();
+        string shardDirectory = string(target) + ".shards";
+        if (mkdir(shardDirectory.data(), 0755) != 0 && errno != EEXIST)
+            throw CoreException("Can't create %s.", shardDirectory.data());
+
+        // Each shard is an index in its own right, with its own manifest and generations, so a change in one tree only rebuilds that tree's
+        // shard; they're built side by side, splitting the threads between them.
+        ngx_xapian_build_options_t shardOptions = *options;
+        int threads = options->threads > 0 ? options->threads : max((int)thread::hardware_concurrency(), 1);
+        shardOptions.threads = max(threads / count, 1);
+        shardOptions.stats = NULL;
+        vector<string> errors(count);
+        vector<ngx_xapian_build_stats_t> shardStats(count, { 0, 0, 0, 0, 0 });
+        // The same directory and regex listed twice is the same shard, and is only built, and searched, once.
+        vector<string> names;
+        for (int i = 0; i < count; ++i)
+            names.push_back(xapian_shard_name(directories[i], regs ? regs[i] : nullptr));
+        vector<thread> builders;
+        for (int i = 0; i < count; ++i) {
+            if (find(names.begin(), names.begin() + i, names[i]) != names.begin() + i)
+                continue;
+            builders.emplace_back([&, i]{
+                string shard = shardDirectory + "/" + names[i];
+                try {
+                    xapian_build_index(directories[i], language, shard.data(), regs ? regs[i] : nullptr, &shardOptions, shardStats[i]);
+                } catch (Xapian::Error& e) {
+                    errors[i] = e.get_msg();
+                } catch (std::exception& e) {
+                    errors[i] = e.what();
+                } catch (...) {
+                    errors[i] = "Unknown error";
+                }
+            });
+        }
+        for (auto& builder : builders)
+            builder.join();
+        for (int i = 0; i < count; ++i) {
+            if (!errors[i].empty())
+                throw CoreException("%s: %s", directories[i], errors[i].data());
+        }
+
+        // Searchers open the index as a stub database listing every shard, so they're searched as one; it's only rewritten when the list changes.
+        BuildLock lock(string(target) + ".lock");
+        size_t slash = shardDirectory.rfind('/');
+        string relative = slash == string::npos ? shardDirectory : shardDirectory.substr(slash + 1);
+        string stub;
+        for (int i = 0; i < count; ++i) {
+            if (find(names.begin(), names.begin() + i, names[i]) == names.begin() + i)
+                stub += "auto " + relative + "/" + names[i] + "\n";
+        }
+        char existing[4096];
+        FILE* file = fopen(target, "rb");
+        size_t length = file ? fread(existing, 1, sizeof(existing), file) : 0;
+        if (file)
+            fclose(file);
+        if (!file || length != stub.size() || memcmp(existing, stub.data(), length) != 0) {
+            string temporary = string(target) + ".tmp";
+            file = fopen(temporary.data(), "wb");
+            if (!file || fwrite(stub.data(), 1, stub.size(), file) != stub.size() || fclose(file) != 0)
+                throw CoreException("Can't write %s.", temporary.data());
+            // Just as with a single index, one that predates generations is a plain directory that can't be renamed over.
+            struct stat status;
+            if (lstat(target, &status) == 0 && S_ISDIR(status.st_mode)) {
+                Generations::remove(target);
+                unlink((string(target) + ".manifest").data());
+            }
+            if (rename(temporary.data(), target) != 0)
+                throw CoreException("Can't publish %s.", target);
+        }
+        // Whatever was built here from a single directory before isn't needed any more.
+        Generations(target).collect(-1);
+        xapian_drop_shards(target, names);
+        if (options->stats) {
+            ngx_xapian_build_stats_t& stats = *options->stats;
+            stats = { 0, 0, 0, 0, 0 };
+            for (auto& shard : shardStats) {
+                stats.documents += shard.documents;
+                stats.skipped += shard.skipped;
+                stats.size += shard.size;
+                stats.compacted_size += shard.compacted_size;
+            }
+            stats.milliseconds = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+        }
+    } catch (Xapian::Error& e) {
+        ngx_xapian_set_error(e.get_msg().data());
+        return -1;
+    } catch (std::exception& e) {
+        ngx_xapian_set_error(e.what());
+        return -1;
+    } catch (...) {
+        ngx_xapian_set_error("Unknown error");
+        return -1;
+    }
+    return 0;
+}
+
+// Appends JSON to a string, which only ever grows, so can be reused between responses. Strings are escaped per RFC 8259; clean runs
+// (anything but a quote, a backslash or a control character) are found a vector at a time and copied in one go.
+struct JsonWriter {
+    string& output;
+
+    JsonWriter(string& output) : output(output) { }
+
+    static bool isClean(unsigned char ch) {
+        return ch >= 0x20 && ch != '"' && ch != '\\';
+    }
+
+    static const char* cleanRun(const char* begin, const char* end) {
+#if defined(__x86_64__) && defined(__SSE2__)
+        const __m128i quote = _mm_set1_epi8('"'), backslash = _mm_set1_epi8('\\'), control = _mm_set1_epi8(0x1F);
+        for (; begin + 16 <= end; begin += 16) {
+            __m128i chunk = _mm_loadu_si128((const __m128i*)begin);
+            // Unsigned chunk <= 0x1F, so that UTF-8 bytes pass through untouched.
+            __m128i matches = _mm_cmpeq_epi8(_mm_max_epu8(chunk, control), control);
+            matches = _mm_or_si128(matches, _mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)));
+            int mask = _mm_movemask_epi8(matches);
+            if (mask)
+                return begin + __builtin_ctz(mask);
+        }
+#endif
+        for (; begin < end && isClean(*begin); ++begin);
+        return begin;
+    }
+
+    JsonWriter& raw(const char* str, size_t len) {
+        output.append(str, len);
+        return *this;
+    }
+
+    JsonWriter& raw(char ch) {
+        output.push_back(ch);
+        return *this;
+    }
+
+    JsonWriter& quoted(const char* str, size_t len) {
+        static const char hex[] = "0123456789abcdef";
+        const char* end = str + len;
+        output.push_back('"');
+        while (str < end) {
+            const char* clean = cleanRun(str, end);
+            output.append(str, clean - str);
+            if (clean == end)
+                break;
+            unsigned char ch = *clean;
+            switch (ch) {
+                case '"': output.append("\\\"", 2); break;
+                case '\\': output.append("\\\\", 2); break;
+                case '\b': output.append("\\b", 2); break;
+                case '\f': output.append("\\f", 2); break;
+                case '\n': output.append("\\n", 2); break;
+                case '\r': output.append("\\r", 2); break;
+                case '\t': output.append("\\t", 2); break;
+                default: {
+                    char escape[6] = { '\\', 'u', '0', '0', hex[ch >> 4], hex[ch & 0xF] };
+                    output.append(escape, sizeof(escape));
+                } break;
+            }
+            str = clean + 1;
+        }
+        output.push_back('"');
+        return *this;
+    }
+
+    JsonWriter& field(const char* name, const char* str, size_t len) {
+        quoted(name, strlen(name));
+        output.push_back(':');
+        return quoted(str, len);
+    }
+};
+
+Liquid::Context& ngx_xapian_get_liquid_context() {
     static Liquid::Context context;
-    if (!init) {
-        init = true;
+    static bool init = [] {
         Liquid::StandardDialect::implementPermissive(context);
         Liquid::WebDialect::implement(context);
-    }
+        return true;
+    }();
+    (void)init;
     return context;
 }
 
-Liquid::Renderer& ngx_xapian_get_renderer() {
-    static Liquid::Renderer renderer(ngx_xapian_get_liquid_context(), Liquid::CPPVariableResolver());
-    return renderer;
-}
-
 void* ngx_xapian_parse_template(const char* buffer, int size) {
     Liquid::Parser parser(ngx_xapian_get_liquid_context());
     Liquid::Node* node = nullptr;
@@ -530,75 +2037,665 @@ void ngx_xapian_free_template(void* tmpl) {
     delete (Liquid::Node*)tmpl;
 }
 
+// Exposes a page of results to Liquid templates as views straight over each document's packed data, instead of copying every field
+// into a CPPVariable tree; both the documents' data and the views are kept between renders, so a warmed up searcher doesn't allocate
+// anything per result. Anything else is left to the usual CPPVariable resolver, other than what the template sets at the top level
+// (with assign, capture, or as a for loop's variable), which the root keeps for itself, as it's no CPPVariable.
+struct TemplateScope {
+    struct View {
+        enum EType { ROOT, SEARCH, RESULTS, RESULT, STRING, INTEGER } type;
+        const char* pointer;
+        // For a result, which one it is; for an integer, its value.
+        size_t length;
+    };
+    // The root, search, search.results, search.terms, search.total and search.offset, followed by each result, and its title,
+    // description, url and path.
+    enum { ROOT_VIEW, SEARCH_VIEW, RESULTS_VIEW, TERMS_VIEW, TOTAL_VIEW, OFFSET_VIEW, RESULT_VIEWS };
+    enum { RESULT, TITLE, DESCRIPTION, URL, PATH, RESULT_FIELDS };
+
+    vector<string> documents;
+    vector<View> views;
+    size_t count;
+    // Set on the root by the template; either views, or variables owned by the fallback resolver, which are freed after each render.
+    vector<pair<string, void*>> assigned;
+
+    // The resolver's callbacks don't get any context of their own; this is whichever scope is being rendered on this thread.
+    static thread_local TemplateScope* current;
+
+    TemplateScope() : count(0) { }
+    ~TemplateScope() { clear(); }
+    TemplateScope(const TemplateScope&) = delete;
+    TemplateScope& operator=(const TemplateScope&) = delete;
+
+    bool contains(void* variable) const {
+        return !views.empty() && (View*)variable >= &views.front() && (View*)variable <= &views.back();
+    }
+
+    void clear() {
+        for (auto& it : assigned) {
+            if (!contains(it.second))
+                fallback().freeVariable(it.second);
+        }
+        assigned.clear();
+    }
+
+    void reset(const char* terms) {
+        clear();
+        count = 0;
+        views.resize(RESULT_VIEWS);
+        views[ROOT_VIEW] = { View::ROOT, nullptr, 0 };
+        views[SEARCH_VIEW] = { View::SEARCH, nullptr, 0 };
+        views[RESULTS_VIEW] = { View::RESULTS, nullptr, 0 };
+        views[TERMS_VIEW] = { View::STRING, terms, strlen(terms) };
+        views[TOTAL_VIEW] = { View::INTEGER, nullptr, 0 };
+        views[OFFSET_VIEW] = { View::INTEGER, nullptr, 0 };
+    }
+
+    void add(const char* data, size_t length) {
+        if (documents.size() <= count)
+            documents.emplace_back();
+        documents[count].assign(data, length);
+        ngx_xapian_result_t result = { documents[count].data(), documents[count].size() };
+        View view = { View::STRING, nullptr, 0 };
+        views.push_back({ View::RESULT, nullptr, count });
+        view.pointer = ngx_xapian_result_get_title(&result, &view.length);
+        views.push_back(view);
+        view.pointer = ngx_xapian_result_get_description(&result, &view.length);
+        views.push_back(view);
+        view.pointer = ngx_xapian_result_get_url(&result, &view.length);
+        views.push_back(view);
+        view.pointer = ngx_xapian_result_get_path(&result, &view.length);
+        views.push_back(view);
+        ++count;
+    }
+
+    static View* view(void* variable) {
+        return current && current->contains(variable) ? (View*)variable : nullptr;
+    }
+
+    static const LiquidVariableResolver& fallback() {
+        static Liquid::CPPVariableResolver resolver;
+        return resolver;
+    }
+
+    static LiquidVariableType getType(void* variable) {
+        View* v = view(variable);
+        if (!v)
+            return fallback().getType(variable);
+        switch (v->type) {
+            case View::RESULTS: return LIQUID_VARIABLE_TYPE_ARRAY;
+            case View::STRING: return LIQUID_VARIABLE_TYPE_STRING;
+            case View::INTEGER: return LIQUID_VARIABLE_TYPE_INT;
+            default: return LIQUID_VARIABLE_TYPE_DICTIONARY;
+        }
+    }
+
+    static bool getBool(void* variable, bool* target) {
+        return view(variable) ? false : fallback().getBool(variable, target);
+    }
+
+    static bool getTruthy(void* variable) {
+        return view(variable) ? true : fallback().getTruthy(variable);
+    }
+
+    static bool getString(void* variable, char* target) {
+        View* v = view(variable);
+        if (!v)
+            return fallback().getString(variable, target);
+        if (v->type != View::STRING)
+            return false;
+        memcpy(target, v->pointer, v->length);
+        return true;
+    }
+
+    static long long getStringLength(void* variable) {
+        View* v = view(variable);
+        if (!v)
+            return fallback().getStringLength(variable);
+        return v->type == View::STRING ? (long long)v->length : -1;
+    }
+
+    static bool getInteger(void* variable, long long* target) {
+        View* v = view(variable);
+        if (!v)
+            return fallback().getInteger(variable, target);
+        if (v->type != View::INTEGER)
+            return false;
+        *target = v->length;
+        return true;
+    }
+
+    static bool getFloat(void* variable, double* target) {
+        View* v = view(variable);
+        if (!v)
+            return fallback().getFloat(variable, target);
+        if (v->type != View::INTEGER)
+            return false;
+        *target = v->length;
+        return true;
+    }
+
+    static bool getDictionaryVariable(void* variable, const char* key, void** target) {
+        View* v = view(variable);
+        if (!v)
+            return fallback().getDictionaryVariable(variable, key, target);
+        vector<View>& views = current->views;
+        int index = -1;
+        switch (v->type) {
+            case View::ROOT:
+                for (auto& it : current->assigned) {
+                    if (it.first == key) {
+                        *target = it.second;
+                        return true;
+                    }
+                }
+                if (strcmp(key, "search") == 0)
+                    index = SEARCH_VIEW;
+                else if (strcmp(key, "terms") == 0)
+                    index = TERMS_VIEW;
+            break;
+            case View::SEARCH:
+                if (strcmp(key, "results") == 0)
+                    index = RESULTS_VIEW;
+                else if (strcmp(key, "terms") == 0)
+                    index = TERMS_VIEW;
+                else if (strcmp(key, "total") == 0)
+                    index = TOTAL_VIEW;
+                else if (strcmp(key, "offset") == 0)
+                    index = OFFSET_VIEW;
+            break;
+            case View::RESULT: {
+                int base = RESULT_VIEWS + v->length * RESULT_FIELDS;
+                if (strcmp(key, "title") == 0)
+                    index = base + TITLE;
+                else if (strcmp(key, "description") == 0)
+                    index = base + DESCRIPTION;
+                else if (strcmp(key, "url") == 0)
+                    index = base + URL;
+                else if (strcmp(key, "path") == 0)
+                    index = base + PATH;
+            } break;
+            default:
+            break;
+        }
+        if (index == -1)
+            return false;
+        *target = &views[index];
+        return true;
+    }
+
+    static bool getArrayVariable(void* variable, long long idx, void** target) {
+        View* v = view(variable);
+        if (!v)
+            return fallback().getArrayVariable(variable, idx, target);
+        if (v->type != View::RESULTS)
+            return false;
+        if (idx < 0)
+            idx += current->count;
+        if (idx < 0 || idx >= (long long)current->count)
+            return false;
+        *target = &current->views[RESULT_VIEWS + idx * RESULT_FIELDS + RESULT];
+        return true;
+    }
+
+    static bool iterate(void* variable, bool (*callback)(void* variable, void* data), void* data, int start, int limit, bool reverse) {
+        View* v = view(variable);
+        if (!v)
+            return fallback().iterate(variable, callback, data, start, limit, reverse);
+        if (v->type != View::RESULTS)
+            return false;
+        long long count = current->count, end = limit >= 0 ? min(count, (long long)start + limit) : count;
+        for (long long i = 0; start + i < end; ++i) {
+            long long idx = reverse ? end - 1 - i : start + i;
+            if (!callback(&current->views[RESULT_VIEWS + idx * RESULT_FIELDS + RESULT], data))
+                break;
+        }
+        return true;
+    }
+
+    static long long getArraySize(void* variable) {
+        View* v = view(variable);
+        if (!v)
+            return fallback().getArraySize(variable);
+        return v->type == View::RESULTS ? (long long)current->count : -1;
+    }
+
+    // The results themselves are read-only; only the root can be added to, and it takes ownership of whatever it's given.
+    static void* setDictionaryVariable(void* variable, const char* key, void* target) {
+        View* v = view(variable);
+        if (!v)
+            return fallback().setDictionaryVariable(variable, key, target);
+        if (v->type != View::ROOT)
+            return nullptr;
+        for (auto& it : current->assigned) {
+            if (it.first == key) {
+                if (it.second != target && !current->contains(it.second))
+                    fallback().freeVariable(it.second);
+                it.second = target;
+                return target;
+            }
+        }
+        current->assigned.emplace_back(key, target);
+        return target;
+    }
+
+    static void* setArrayVariable(void* variable, long long idx, void* target) {
+        return view(variable) ? nullptr : fallback().setArrayVariable(variable, idx, target);
+    }
+
+    static void* createClone(void* value) {
+        return view(value) ? value : fallback().createClone(value);
+    }
+
+    static void freeVariable(void* value) {
+        if (!view(value))
+            fallback().freeVariable(value);
+    }
+
+    static int compare(void* a, void* b) {
+        View* left = view(a);
+        View* right = view(b);
+        if (!left && !right)
+            return fallback().compare(a, b);
+        if (left && right && left->type == View::INTEGER && right->type == View::INTEGER)
+            return left->length < right->length ? -1 : (left->length > right->length ? 1 : 0);
+        if (left && right && left->type == View::STRING && right->type == View::STRING) {
+            int result = memcmp(left->pointer, right->pointer, min(left->length, right->length));
+            return result ? result : (left->length < right->length ? -1 : (left->length > right->length ? 1 : 0));
+        }
+        return a < b ? -1 : (a > b ? 1 : 0);
+    }
+
+    static const LiquidVariableResolver& resolver() {
+        static LiquidVariableResolver resolver = [] {
+            LiquidVariableResolver resolver = fallback();
+            resolver.getType = getType;
+            resolver.getBool = getBool;
+            resolver.getTruthy = getTruthy;
+            resolver.getString = getString;
+            resolver.getStringLength = getStringLength;
+            resolver.getInteger = getInteger;
+            resolver.getFloat = getFloat;
+            resolver.getDictionaryVariable = getDictionaryVariable;
+            resolver.getArrayVariable = getArrayVariable;
+            resolver.iterate = iterate;
+            resolver.getArraySize = getArraySize;
+            resolver.setDictionaryVariable = setDictionaryVariable;
+            resolver.setArrayVariable = setArrayVariable;
+            resolver.createClone = createClone;
+            resolver.freeVariable = freeVariable;
+            resolver.compare = compare;
+            return resolver;
+        }();
+        return resolver;
+    }
+};
+
+thread_local TemplateScope* TemplateScope::current = nullptr;
+
+// Everything needed to search one index in one language, kept between searches: the open database, a configured query parser, an
+// Enquire, a renderer, and somewhere to put errors. A searcher must only be used by one thread at a time.
+struct ngx_xapian_searcher_s {
+    OpenIndex index;
+    QueryParser queryParser;
+    Enquire enquire;
+    unsigned long long enquireRevision;
+    // Terms for the language filters that have been asked for, by code; only those with a stemmer, so there's only ever so many.
+    unordered_map<string, string> languageTerms;
+    string data;
+    string json;
+    TemplateScope scope;
+    Liquid::Renderer renderer;
+    bool hasError;
+    char error[1024];
+
+    ngx_xapian_searcher_s(const char* index, const char* language) : index(index), enquire(this->index.get()), enquireRevision(this->index.revision), renderer(ngx_xapian_get_liquid_context(), TemplateScope::resolver()), hasError(false) {
+        queryParser.set_stemmer(Stem(language));
+        queryParser.set_stemming_strategy(QueryParser::STEM_SOME);
+    }
+
+    void setError(const char* message) {
+        hasError = true;
+        strncpy(error, message, sizeof(error) - 1);
+        error[sizeof(error) - 1] = 0;
+    }
+
+    Enquire& getEnquire() {
+        Database& database = index.get();
+        if (enquireRevision != index.revision) {
+            enquire = Enquire(database);
+            enquireRevision = index.revision;
+        }
+        return enquire;
+    }
+
+    string getLanguageTerm(const char* language) {
+        string code = xapian_language_code(language, strlen(language));
+        // Nothing's indexed in a language too long to have a code; and an empty code would be taken as Xapian's "none" stemmer.
+        if (code.empty())
+            return "L";
+        auto it = languageTerms.find(code);
+        if (it != languageTerms.end())
+            return it->second;
+        string term;
+        try {
+            term = xapian_language_term(Stem(code), code);
+        } catch (InvalidArgumentError& e) {
+            // Whatever's asked for here comes from the request; only what's known to Xapian is worth keeping.
+            return "L" + code;
+        }
+        return languageTerms.emplace(code, term).first->second;
+    }
+
+    int search(ngx_xapian_query_t* query, ngx_xapian_result_callbackp resultCallback, void* callbackData) {
+        Enquire& inquiry = getEnquire();
+        // A language restriction is applied by the matcher, as a boolean filter; it narrows the posting lists that have to be walked,
+        // rather than throwing results away afterwards.
+        if (query->language && query->language[0])
+            inquiry.set_query(Query(Query::OP_FILTER, queryParser.parse_query(query->query), Query(getLanguageTerm(query->language))));
+        else
+            inquiry.set_query(queryParser.parse_query(query->query));
+        inquiry.set_time_limit(query->time_limit);
+        // Only check as far as telling whether there's another page, rather than looking for every match; the total's an estimate.
+        doccount offset = max(query->offset, 0), count = max(query->max_results, 0);
+        MSet docset;
+        // Only an index that's being written to in place can change out from under us; for those, catch up and try once more.
+        try {
+            docset = inquiry.get_mset(offset, count, offset + count + 1);
+        } catch (DatabaseModifiedError& e) {
+            index.reopen();
+            docset = inquiry.get_mset(offset, count, offset + count + 1);
+        }
+        query->estimated_total = docset.get_matches_estimated();
+
+        int total = 0;
+        for (MSet::iterator it = docset.begin(); it != docset.end(); ++it) {
+            Document document;
+            try {
+                document = it.get_document();
+            } catch (DatabaseModifiedError& e) {
+                index.reopen();
+                document = it.get_document();
+            }
+            data = document.get_data();
+            resultCallback({ data.data(), data.size() }, callbackData);
+            ++total;
+        }
+        return total;
+    }
+
+    int searchTemplate(ngx_xapian_query_t* query, void* tmpl, ngx_xapian_chunk_callbackp chunkCallback, void* data) {
+        scope.reset(query->query);
+        int resultCount = this->search(query, +[](ngx_xapian_result_t result, void* data){
+            ((TemplateScope*)data)->add(result.pointer, result.length);
+        }, &scope);
+        scope.views[TemplateScope::TOTAL_VIEW].length = query->estimated_total;
+        scope.views[TemplateScope::OFFSET_VIEW].length = max(query->offset, 0);
+        TemplateScope::current = &scope;
+        std::string result;
+        try {
+            result = renderer.render(*(Liquid::Node*)tmpl, Liquid::Variable(&scope.views[TemplateScope::ROOT_VIEW]));
+        } catch (...) {
+            scope.clear();
+            TemplateScope::current = nullptr;
+            throw;
+        }
+        scope.clear();
+        TemplateScope::current = nullptr;
+        chunkCallback(result.data(), result.size(), data);
+        return resultCount;
+    }
+
+    int searchJson(ngx_xapian_query_t* query, ngx_xapian_chunk_callbackp chunkCallback, void* data) {
+        // The whole response is built up in the searcher's buffer, and handed over in one go.
+        json.clear();
+        JsonWriter writer(json);
+        writer.raw("{\"results\":[", sizeof("{\"results\":[")-1);
+        this->search(query, +[](ngx_xapian_result_t result, void* data){
+            JsonWriter& writer = *(JsonWriter*)data;
+            if (writer.output.back() != '[')
+                writer.raw(',');
+            size_t len;
+            const char* buf = ngx_xapian_result_get_path(&result, &len);
+            writer.raw('{').field("path", buf, len).raw(',');
+            buf = ngx_xapian_result_get_title(&result, &len);
+            writer.field("title", buf, len).raw(',');
+            buf = ngx_xapian_result_get_description(&result, &len);
+            writer.field("description", buf, len);
+            buf = ngx_xapian_result_get_url(&result, &len);
+            if (len > 0)
+                writer.raw(',').field("url", buf, len);
+            writer.raw('}');
+        }, &writer);
+        char total[32];
+        writer.raw(total, snprintf(total, sizeof(total), "],\"total\":%d}", query->estimated_total));
+        chunkCallback(json.data(), json.size(), data);
+        return json.size();
+    }
+};
+
+ngx_xapian_searcher_t* ngx_xapian_searcher_open(const char* index, const char* language) {
+    try {
+        return new ngx_xapian_searcher_s(index, language);
+    } catch (Xapian::Error& e) {
+        ngx_xapian_set_error(e.get_msg().data());
+    } catch (std::exception& e) {
+        ngx_xapian_set_error(e.what());
+    } catch (...) {
+        ngx_xapian_set_error("Unknown error");
+    }
+    return nullptr;
+}
+
+void ngx_xapian_searcher_close(ngx_xapian_searcher_t* searcher) {
+    delete searcher;
+}
+
+const char* ngx_xapian_searcher_get_error(ngx_xapian_searcher_t* searcher) {
+    if (!searcher->hasError)
+        return nullptr;
+    searcher->hasError = false;
+    return searcher->error;
+}
+
+int ngx_xapian_searcher_get_revision(ngx_xapian_searcher_t* searcher, unsigned long long* revision, time_t* modified) {
+    try {
+        searcher->index.get();
+        *revision = searcher->index.revision;
+        if (modified)
+            *modified = searcher->index.modified.tv_sec;
+    } catch (Xapian::Error& e) {
+        searcher->setError(e.get_msg().data());
+        return -1;
+    } catch (std::exception& e) {
+        searcher->setError(e.what());
+        return -1;
+    } catch (...) {
+        searcher->setError("Unknown error");
+        return -1;
+    }
+    return 0;
+}
+
+void ngx_xapian_query_init(ngx_xapian_query_t* query) {
+    query->query = "";
+    query->offset = 0;
+    query->max_results = 12;
+    query->time_limit = 0.0;
+    query->language = NULL;
+    query->estimated_total = 0;
+}
+
+int ngx_xapian_searcher_query(ngx_xapian_searcher_t* searcher, ngx_xapian_query_t* query, ngx_xapian_result_callbackp resultCallback, void* data) {
+    try {
+        return searcher->search(query, resultCallback, data);
+    } catch (Xapian::Error& e) {
+        searcher->setError(e.get_msg().data());
+    } catch (std::exception& e) {
+        searcher->setError(e.what());
+    } catch (...) {
+        searcher->setError("Unknown error");
+    }
+    return -1;
+}
+
+int ngx_xapian_searcher_query_json(ngx_xapian_searcher_t* searcher, ngx_xapian_query_t* query, ngx_xapian_chunk_callbackp chunkCallback, void* data) {
+    try {
+        return searcher->searchJson(query, chunkCallback, data);
+    } catch (Xapian::Error& e) {
+        searcher->setError(e.get_msg().data());
+    } catch (std::exception& e) {
+        searcher->setError(e.what());
+    } catch (...) {
+        searcher->setError("Unknown error");
+    }
+    return -1;
+}
+
+int ngx_xapian_searcher_query_template(ngx_xapian_searcher_t* searcher, ngx_xapian_query_t* query, void* tmpl, ngx_xapian_chunk_callbackp chunkCallback, void* data) {
+    try {
+        return searcher->searchTemplate(query, tmpl, chunkCallback, data);
+    } catch (Xapian::Error& e) {
+        searcher->setError(e.get_msg().data());
+    } catch (std::exception& e) {
+        searcher->setError(e.what());
+    } catch (...) {
+        searcher->setError("Unknown error");
+    }
+    return -1;
+}
+
+static ngx_xapian_query_t xapian_query(const char* query, int max_results) {
+    ngx_xapian_query_t result;
+    ngx_xapian_query_init(&result);
+    result.query = query;
+    result.max_results = max_results;
+    return result;
+}
+
+int ngx_xapian_searcher_search(ngx_xapian_searcher_t* searcher, const char* query, int max_results, ngx_xapian_result_callbackp resultCallback, void* data) {
+    ngx_xapian_query_t parameters = xapian_query(query, max_results);
+    return ngx_xapian_searcher_query(searcher, &parameters, resultCallback, data);
+}
+
+int ngx_xapian_searcher_search_json(ngx_xapian_searcher_t* searcher, const char* query, int max_results, ngx_xapian_chunk_callbackp chunkCallback, void* data) {
+    ngx_xapian_query_t parameters = xapian_query(query, max_results);
+    return ngx_xapian_searcher_query_json(searcher, &parameters, chunkCallback, data);
+}
+
+int ngx_xapian_searcher_search_template(ngx_xapian_searcher_t* searcher, const char* query, int max_results, void* tmpl, ngx_xapian_chunk_callbackp chunkCallback, void* data) {
+    ngx_xapian_query_t parameters = xapian_query(query, max_results);
+    return ngx_xapian_searcher_query_template(searcher, &parameters, tmpl, chunkCallback, data);
+}
+
+// The older, handle-less API keeps a searcher per index and language for each thread, and reports errors through ngx_xapian_get_error.
+static thread_local unordered_map<string, unique_ptr<ngx_xapian_searcher_t>> searchers;
+
+static ngx_xapian_searcher_t* xapian_searcher(const char* index, const char* language) {
+    string key = string(index) + '\0' + language;
+    auto it = searchers.find(key);
+    if (it != searchers.end())
+        return it->second.get();
+    ngx_xapian_searcher_t* searcher = ngx_xapian_searcher_open(index, language);
+    if (searcher)
+        searchers.emplace(key, unique_ptr<ngx_xapian_searcher_t>(searcher));
+    return searcher;
+}
+
+static int xapian_searcher_result(ngx_xapian_searcher_t* searcher, int result) {
+    if (result < 0)
+        ngx_xapian_set_error(ngx_xapian_searcher_get_error(searcher));
+    return result;
+}
+
+int ngx_xapian_open_index(const char* index, const char* language) {
+    return xapian_searcher(index, language) ? 0 : -1;
+}
+
+int ngx_xapian_get_revision(const char* index, const char* language, unsigned long long* revision, time_t* modified) {
+    ngx_xapian_searcher_t* searcher = xapian_searcher(index, language);
+    return searcher ? xapian_searcher_result(searcher, ngx_xapian_searcher_get_revision(searcher, revision, modified)) : -1;
+}
+
+int ngx_xapian_prepare_language(const char* language) {
+    try {
+        Stem stem(language);
+    } catch (Xapian::Error& e) {
+        ngx_xapian_set_error(e.get_msg().data());
+        return -1;
+    } catch (std::exception& e) {
+        ngx_xapian_set_error(e.what());
+        return -1;
+    } catch (...) {
+        ngx_xapian_set_error("Unknown error");
+        return -1;
+    }
+    return 0;
+}
+
+void ngx_xapian_close_indexes() {
+    searchers.clear();
+}
+
+int ngx_xapian_search_index(const char* index, const char* language, const char* query, int max_results, ngx_xapian_result_callbackp resultCallback, void* data) {
+    ngx_xapian_searcher_t* searcher = xapian_searcher(index, language);
+    return searcher ? xapian_searcher_result(searcher, ngx_xapian_searcher_search(searcher, query, max_results, resultCallback, data)) : -1;
+}
+
 int ngx_xapian_search_template(const char* index, const char* language, const char* query, int max_results, void* tmpl, ngx_xapian_chunk_callbackp chunkCallback, void* data) {
-    Liquid::CPPVariable hash, search, results;
-    int resultCount = ngx_xapian_search_index(index, language, query, max_results, +[](ngx_xapian_result_t result, void* data){
-        Liquid::CPPVariable* results = (Liquid::CPPVariable*)data;
-        std::unique_ptr<Liquid::CPPVariable> cppResult = std::make_unique<Liquid::CPPVariable>();
-        size_t titleLength;
-        const char* title = ngx_xapian_result_get_title(&result, &titleLength);
-        size_t descriptionLength;
-        const char* description = ngx_xapian_result_get_description(&result, &descriptionLength);
-        size_t urlLength;
-        const char* url = ngx_xapian_result_get_url(&result, &urlLength);
-        (*cppResult.get())["url"] = string(url, urlLength);
-        (*cppResult.get())["title"] = string(title, titleLength);
-        (*cppResult.get())["description"] = string(description, descriptionLength);
-        results->pushBack(move(cppResult));
-    }, &results);
-    search["results"] = move(results);
-    hash["search"] = move(search);
-    hash["terms"] = string(query);
-    Liquid::Renderer& renderer = ngx_xapian_get_renderer();
-    std::string result = renderer.render(*(Liquid::Node*)tmpl, hash);
-    chunkCallback(result.data(), result.size(), data);
-    return resultCount;
-}
-
-// Should be free'd with 'free' after use.
+    ngx_xapian_searcher_t* searcher = xapian_searcher(index, language);
+    return searcher ? xapian_searcher_result(searcher, ngx_xapian_searcher_search_template(searcher, query, max_results, tmpl, chunkCallback, data)) : -1;
+}
+
 int ngx_xapian_search_index_json(const char* index, const char* language, const char* query, int max_results, ngx_xapian_chunk_callbackp chunkCallback, void* data) {
-    tuple<void*, void*, int, bool> values((void*)chunkCallback, (void*)data, 0, true);
-    chunkCallback("{\"results\":[", sizeof("{\"results\":[")-1, data);
-    get<2>(values) += sizeof("{\"results\":[")-1;
-    int total = ngx_xapian_search_index(index, language, query, max_results, +[](ngx_xapian_result_t result, void* data){
-        auto values = (tuple<void*, void*, int, bool>*)data;
-        ngx_xapian_chunk_callbackp chunkCallback = (ngx_xapian_chunk_callbackp)get<0>(*values);
-        if (!get<3>(*values)) {
-            chunkCallback(",", 1, get<1>(*values));
-            get<2>(*values) += 1;
-        } else {
-            get<3>(*values) = false;
-        }
-
-        // Rather than including rapidJSON, just pump these strings in. If it proves problematic, we'll include the library.
-        char outputBuffer[1024*4] = "{";
-        unsigned int offset = 1;
-
-        size_t len;
-        const char* buf = ngx_xapian_result_get_path(&result, &len);
-        offset += copyToJsonField(&outputBuffer[offset], "path", buf, len);
-        outputBuffer[offset++] = ',';
-        buf = ngx_xapian_result_get_title(&result, &len);
-        offset += copyToJsonField(&outputBuffer[offset], "title", buf, len);
-        outputBuffer[offset++] = ',';
-        buf = ngx_xapian_result_get_description(&result, &len);
-        offset += copyToJsonField(&outputBuffer[offset], "description", buf, len);
-        buf = ngx_xapian_result_get_url(&result, &len);
-        if (len > 0) {
-            outputBuffer[offset++] = ',';
-            offset += copyToJsonField(&outputBuffer[offset], "url", buf, len);
-        }
-        outputBuffer[offset++] = '}';
-        outputBuffer[offset] = 0;
-
-
-        chunkCallback(outputBuffer, offset, get<1>(*values));
-        get<2>(*values) += offset;
-    }, &values);
-    if (total < 0)
-        return total;
-    chunkCallback("]}", 2, data);
-    get<2>(values) += 2;
-    return get<2>(values);
+    ngx_xapian_searcher_t* searcher = xapian_searcher(index, language);
+    return searcher ? xapian_searcher_result(searcher, ngx_xapian_searcher_search_json(searcher, query, max_results, chunkCallback, data)) : -1;
 }
 
+int ngx_xapian_query_index_json(const char* index, const char* language, ngx_xapian_query_t* query, ngx_xapian_chunk_callbackp chunkCallback, void* data) {
+    ngx_xapian_searcher_t* searcher = xapian_searcher(index, language);
+    return searcher ? xapian_searcher_result(searcher, ngx_xapian_searcher_query_json(searcher, query, chunkCallback, data)) : -1;
+}
+
+int ngx_xapian_query_index_template(const char* index, const char* language, ngx_xapian_query_t* query, void* tmpl, ngx_xapian_chunk_callbackp chunkCallback, void* data) {
+    ngx_xapian_searcher_t* searcher = xapian_searcher(index, language);
+    return searcher ? xapian_searcher_result(searcher, ngx_xapian_searcher_query_template(searcher, query, tmpl, chunkCallback, data)) : -1;
+}
+
+int ngx_xapian_etag_matches(const char* header, size_t headerLength, const char* etag, size_t etagLength) {
+    // Weak comparison ignores whether either side is weak.
+    if (etagLength >= 2 && etag[0] == 'W' && etag[1] == '/') {
+        etag += 2;
+        etagLength -= 2;
+    }
+    const char* p = header;
+    const char* last = header + headerLength;
+    while (p < last) {
+        while (p < last && (*p == ' ' || *p == '\t' || *p == ','))
+            ++p;
+        if (p == last)
+            break;
+        const char* tag = p;
+        if (*p == '*') {
+            ++p;
+        } else {
+            if (last - p >= 2 && p[0] == 'W' && p[1] == '/')
+                tag = p += 2;
+            // An opaque tag may hold commas of its own, so it's read up to its closing quote.
+            if (p < last && *p == '"') {
+                for (++p; p < last && *p != '"'; ++p);
+                if (p < last)
+                    ++p;
+            }
+        }
+        if (p == last || *p == ',' || *p == ' ' || *p == '\t') {
+            if (p - tag == 1 && *tag == '*')
+                return 1;
+            if ((size_t)(p - tag) == etagLength && etagLength > 0 && memcmp(tag, etag, etagLength) == 0)
+                return 1;
+        }
+        while (p < last && *p != ',')
+            ++p;
+    }
+    return 0;
+}
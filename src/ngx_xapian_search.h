@@ -1,6 +1,7 @@
 #ifndef NGX_XAPIAN_SEARCH_H
 #define NGX_XAPIAN_SEARCH_H
 
+#include <time.h>
 #include <liquid/liquid.h>
 
 #ifdef __cplusplus
@@ -24,16 +25,95 @@ extern "C" {
     const char* ngx_xapian_result_get_url(ngx_xapian_result_t* result, size_t* len);
 
 
+    // What a build did, for logging.
+    struct ngx_xapian_build_stats_s {
+        unsigned long long milliseconds;
+        unsigned long long documents;
+        // Files that disappeared between being found and being read, and so were left out.
+        unsigned long long skipped;
+        // Bytes on disk, as written, and after compaction; the latter is 0 if the index wasn't compacted.
+        unsigned long long size;
+        unsigned long long compacted_size;
+    };
+    typedef struct ngx_xapian_build_stats_s ngx_xapian_build_stats_t;
+
+    struct ngx_xapian_build_options_s {
+        // Number of threads parsing files; 0 uses one per core.
+        int threads;
+        // Whether body text is indexed with positions, as the title, keywords and description always are; without them, the index is
+        // much smaller, but phrases can only be matched in the latter.
+        int body_positions;
+        // How many documents are written between commits, and roughly how much memory they may take up before one is made regardless;
+        // 0 for no limit. With neither, the whole build is a single commit.
+        int docs_per_commit;
+        size_t memory_budget;
+        // Whether each build is compacted into a single file once it's done, before it's published.
+        int compact;
+        // Filled in once a build succeeds, if set.
+        ngx_xapian_build_stats_t* stats;
+    };
+    typedef struct ngx_xapian_build_options_s ngx_xapian_build_options_t;
+
+    struct ngx_xapian_query_s {
+        const char* query;
+        // Results to skip, and how many to return after that.
+        int offset;
+        int max_results;
+        // Seconds to spend matching before settling for the best found so far; 0 for no limit.
+        double time_limit;
+        // Only return documents in this language, if set; as in <meta name="language"> or <html lang>.
+        const char* language;
+        // Set by the search; an estimate of how many documents match in all.
+        int estimated_total;
+    };
+    typedef struct ngx_xapian_query_s ngx_xapian_query_t;
+
     const char* ngx_xapian_get_error();
     void ngx_xapian_clear_error();
 
+    void ngx_xapian_build_options_init(ngx_xapian_build_options_t* options);
+    void ngx_xapian_query_init(ngx_xapian_query_t* query);
     int ngx_xapian_build_index(const char* directory, const char* language, const char* target, const char* reg);
+    int ngx_xapian_build_index_with_options(const char* directory, const char* language, const char* target, const char* reg, const ngx_xapian_build_options_t* options);
+    // Builds each directory (filtered by the matching regex, if regs and it are non-null) as a shard of its own, all at once, and makes
+    // target a stub database listing them, so that it's searched as one index. A single directory is built just as by the above.
+    int ngx_xapian_build_shards(const char* const* directories, const char* const* regs, int count, const char* language, const char* target, const ngx_xapian_build_options_t* options);
+    // A searcher keeps an index open between searches, reopening it only when it's been rebuilt, along with everything else a search in
+    // one language needs. It reports its own errors, and can be used from any thread, though only by one at a time. If opening fails,
+    // the error is available from ngx_xapian_get_error.
+    typedef struct ngx_xapian_searcher_s ngx_xapian_searcher_t;
+
+    ngx_xapian_searcher_t* ngx_xapian_searcher_open(const char* index, const char* language);
+    void ngx_xapian_searcher_close(ngx_xapian_searcher_t* searcher);
+    const char* ngx_xapian_searcher_get_error(ngx_xapian_searcher_t* searcher);
+    // Changes whenever the index does, after catching up with any rebuild; results cached under one revision are stale under any other.
+    // If modified isn't NULL, it's set to when the index was last written.
+    int ngx_xapian_searcher_get_revision(ngx_xapian_searcher_t* searcher, unsigned long long* revision, time_t* modified);
+    int ngx_xapian_searcher_search(ngx_xapian_searcher_t* searcher, const char* query, int max_results, ngx_xapian_result_callbackp resultCallback, void* data);
+    int ngx_xapian_searcher_search_json(ngx_xapian_searcher_t* searcher, const char* query, int max_results, ngx_xapian_chunk_callbackp chunkCallback, void* data);
+    int ngx_xapian_searcher_search_template(ngx_xapian_searcher_t* searcher, const char* query, int max_results, void* tmpl, ngx_xapian_chunk_callbackp chunkCallback, void* data);
+    int ngx_xapian_searcher_query(ngx_xapian_searcher_t* searcher, ngx_xapian_query_t* query, ngx_xapian_result_callbackp resultCallback, void* data);
+    int ngx_xapian_searcher_query_json(ngx_xapian_searcher_t* searcher, ngx_xapian_query_t* query, ngx_xapian_chunk_callbackp chunkCallback, void* data);
+    int ngx_xapian_searcher_query_template(ngx_xapian_searcher_t* searcher, ngx_xapian_query_t* query, void* tmpl, ngx_xapian_chunk_callbackp chunkCallback, void* data);
+
+    // The functions below keep a searcher per index and language for each calling thread, and report errors per thread through
+    // ngx_xapian_get_error. These let a thread open its searchers ahead of its first search, and let go of them all when it's done.
+    int ngx_xapian_open_index(const char* index, const char* language);
+    void ngx_xapian_close_indexes();
+    int ngx_xapian_get_revision(const char* index, const char* language, unsigned long long* revision, time_t* modified);
+    // Checks there's a stemmer for the language.
+    int ngx_xapian_prepare_language(const char* language);
     int ngx_xapian_search_index(const char* index, const char* language, const char* query, int max_results, ngx_xapian_result_callbackp resultCallback, void* data);
     int ngx_xapian_search_index_json(const char* index, const char* language, const char* query, int max_results, ngx_xapian_chunk_callbackp chunkCallback, void* data);
+    int ngx_xapian_query_index_json(const char* index, const char* language, ngx_xapian_query_t* query, ngx_xapian_chunk_callbackp chunkCallback, void* data);
 
     void* ngx_xapian_parse_template(const char* buffer, int size);
     void ngx_xapian_free_template(void* tmpl);
     int ngx_xapian_search_template(const char* index, const char* language, const char* query, int max_results, void* tmpl, ngx_xapian_chunk_callbackp chunkCallback, void* data);
+    int ngx_xapian_query_index_template(const char* index, const char* language, ngx_xapian_query_t* query, void* tmpl, ngx_xapian_chunk_callbackp chunkCallback, void* data);
+
+    // Whether an If-None-Match header lists the etag (quotes and all), by weak comparison, as per RFC 9110.
+    int ngx_xapian_etag_matches(const char* header, size_t header_length, const char* etag, size_t etag_length);
 #ifdef __cplusplus
 };
 #endif
@@ -7,33 +7,160 @@ extern "C" {
 };
 #include "ngx_xapian_search.h"
 
+/* how many results can be asked for at once, and how deep into the results a page can start; past that, a search costs more than it's worth. */
+#define NGX_XAPIAN_SEARCH_DEFAULT_RESULTS 12
+#define NGX_XAPIAN_SEARCH_MAX_RESULTS 100
+#define NGX_XAPIAN_SEARCH_MAX_OFFSET 1000
+
+/* a compiled template; referenced by the location for as long as it's current, and by every request rendering it, which may outlast that. */
+typedef struct {
+    void* contents;
+    ngx_uint_t references;
+} ngx_xapian_search_compiled_template_t;
+
+/* a location's template, recompiled in place whenever the file changes. Each worker has its own copy after the fork. */
+typedef struct {
+    ngx_str_t path;
+    ngx_xapian_search_compiled_template_t* compiled;
+    time_t mtime;
+    off_t size;
+    ngx_msec_t checked;
+} ngx_xapian_search_template_t;
+
+/* a tree to index, and optionally which of its files to; each is built as a shard of the location's index. */
+typedef struct {
+    ngx_str_t path;
+    ngx_str_t regex;
+} ngx_xapian_search_directory_t;
+
 typedef struct {
     ngx_flag_t enabled;
     ngx_array_t* directory;
     ngx_str_t index;
     ngx_str_t tmpl;
-    void* tmpl_contents;
+    ngx_xapian_search_template_t* tmpl_contents;
+    ngx_msec_t tmpl_check_interval;
+    ngx_str_t cache_control;
+    ngx_int_t index_threads;
+    ngx_flag_t body_positions;
+    ngx_flag_t compact;
+    ngx_int_t index_docs_per_commit;
+    size_t index_memory;
+    ngx_str_t language;
+    ngx_msec_t time_limit;
+#if (NGX_THREADS)
+    ngx_thread_pool_t* thread_pool;
+#endif
 } ngx_xapian_search_conf_t;
 
+/* a cached response, in the shared memory zone; data holds the cache key followed by the response body. */
+typedef struct {
+    ngx_rbtree_node_t node;
+    ngx_queue_t queue;
+    unsigned long long revision;
+    size_t key_len;
+    size_t body_len;
+    u_char data[1];
+} ngx_xapian_search_cache_node_t;
+
+typedef struct {
+    ngx_rbtree_t rbtree;
+    ngx_rbtree_node_t sentinel;
+    /* most recently used first. */
+    ngx_queue_t lru;
+    ngx_atomic_uint_t hits;
+    ngx_atomic_uint_t misses;
+} ngx_xapian_search_cache_sh_t;
+
+typedef struct {
+    ngx_xapian_search_cache_sh_t *sh;
+    ngx_slab_pool_t *shpool;
+} ngx_xapian_search_cache_t;
+
+enum {
+    NGX_XAPIAN_CACHE_BYPASS = 0,
+    NGX_XAPIAN_CACHE_MISS,
+    NGX_XAPIAN_CACHE_HIT
+};
+
+typedef struct ngx_xapian_search_block_s {
+    struct ngx_xapian_search_block_s* next;
+    size_t size;
+    size_t used;
+    u_char data[1];
+} ngx_xapian_search_block_t;
+
+/* everything about a single search, so that it can be handed off to a thread pool and finished once it's done. */
+typedef struct {
+    ngx_uint_t cache_status;
+    ngx_str_t cache_key;
+    unsigned long long revision;
+    ngx_flag_t json;
+    const char* index;
+    const char* language;
+    ngx_xapian_search_compiled_template_t* tmpl;
+    time_t modified;
+    ngx_int_t results;
+    ngx_int_t page;
+    ngx_msec_t time_limit;
+    /* only documents in this language are returned, if set; it points just past the '=' in language_buffer, which marks a filtered search in the cache key. */
+    const char* filter;
+    u_char language_buffer[32];
+    u_char query[1024];
+    /* the response; either straight from the cache, or from the blocks the search wrote to. */
+    ngx_chain_t* out;
+    size_t length;
+    ngx_xapian_search_block_t* first;
+    ngx_xapian_search_block_t* last;
+    ngx_flag_t failed;
+    u_char error[1024];
+} ngx_xapian_search_ctx_t;
+
+typedef struct {
+    // Every location that has an index to build, one per distinct index path.
+    ngx_array_t builds;
+    // Every location that searches, one per distinct index and language.
+    ngx_array_t searchers;
+    // Rendered responses, shared between workers; NULL unless xapian_cache is set.
+    ngx_shm_zone_t* cache_zone;
+} ngx_xapian_search_main_conf_t;
+
 
 static char * ngx_xapian_search_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child);
 static void * ngx_xapian_search_create_loc_conf(ngx_conf_t *cf);
+static void * ngx_xapian_search_create_main_conf(ngx_conf_t *cf);
 static ngx_int_t ngx_xapian_search_handler(ngx_http_request_t *r);
 static ngx_int_t ngx_xapian_search_init(ngx_conf_t *cf);
+static ngx_int_t ngx_xapian_search_add_variables(ngx_conf_t *cf);
+static char* ngx_xapian_search_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+#if (NGX_THREADS)
+static char* ngx_xapian_search_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+#endif
+static ngx_int_t ngx_xapian_search_init_module(ngx_cycle_t *cycle);
+static ngx_int_t ngx_xapian_search_init_process(ngx_cycle_t *cycle);
+static void ngx_xapian_search_exit_process(ngx_cycle_t *cycle);
 
-static char* ngx_conf_set_str_array(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+static char* ngx_xapian_search_directory(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    char  *p = (char*)conf;
-
-    ngx_array_t** field = (ngx_array_t**) (p + cmd->offset);
-
-    *field = ngx_array_create(cf->pool, 4, sizeof(ngx_str_t));
-
-    ngx_array_push_n(*field, cf->args->nelts - 1);
-
-    for (size_t i = 1; i < cf->args->nelts; ++i)
-        ((ngx_str_t*)(*field)->elts)[i-1] = ((ngx_str_t*)cf->args->elts)[i];
+    ngx_xapian_search_conf_t *lcf = (ngx_xapian_search_conf_t*)conf;
+    ngx_str_t *value = (ngx_str_t*)cf->args->elts;
 
+    /* each occurrence adds another tree, rather than replacing the last. */
+    if (lcf->directory == NULL) {
+        lcf->directory = ngx_array_create(cf->pool, 4, sizeof(ngx_xapian_search_directory_t));
+        if (lcf->directory == NULL)
+            return (char*)NGX_CONF_ERROR;
+    }
+    ngx_xapian_search_directory_t* directory = (ngx_xapian_search_directory_t*)ngx_array_push(lcf->directory);
+    if (directory == NULL)
+        return (char*)NGX_CONF_ERROR;
+    directory->path = value[1];
+    if (cf->args->nelts == 3) {
+        directory->regex = value[2];
+    } else {
+        directory->regex.len = 0;
+        directory->regex.data = NULL;
+    }
     return NGX_CONF_OK;
 }
 
@@ -48,10 +175,10 @@ static ngx_command_t  ngx_xapian_search_commands[] = {
         NULL
     }, {
         ngx_string("xapian_directory"),
-        NGX_CONF_TAKE12	|NGX_HTTP_LOC_CONF,
-        ngx_conf_set_str_array,
+        NGX_CONF_TAKE12|NGX_HTTP_LOC_CONF,
+        ngx_xapian_search_directory,
         NGX_HTTP_LOC_CONF_OFFSET,
-        offsetof(ngx_xapian_search_conf_t, directory),
+        0,
         NULL
     }, {
         ngx_string("xapian_index"),
@@ -67,16 +194,96 @@ static ngx_command_t  ngx_xapian_search_commands[] = {
         NGX_HTTP_LOC_CONF_OFFSET,
         offsetof(ngx_xapian_search_conf_t, tmpl),
         NULL
+    }, {
+        ngx_string("xapian_template_check_interval"),
+        NGX_CONF_TAKE1|NGX_HTTP_LOC_CONF,
+        ngx_conf_set_msec_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_xapian_search_conf_t, tmpl_check_interval),
+        NULL
+    }, {
+        ngx_string("xapian_cache_control"),
+        NGX_CONF_TAKE1|NGX_HTTP_LOC_CONF,
+        ngx_conf_set_str_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_xapian_search_conf_t, cache_control),
+        NULL
+    }, {
+        ngx_string("xapian_index_threads"),
+        NGX_CONF_TAKE1|NGX_HTTP_LOC_CONF,
+        ngx_conf_set_num_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_xapian_search_conf_t, index_threads),
+        NULL
+    }, {
+        ngx_string("xapian_index_docs_per_commit"),
+        NGX_CONF_TAKE1|NGX_HTTP_LOC_CONF,
+        ngx_conf_set_num_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_xapian_search_conf_t, index_docs_per_commit),
+        NULL
+    }, {
+        ngx_string("xapian_index_memory"),
+        NGX_CONF_TAKE1|NGX_HTTP_LOC_CONF,
+        ngx_conf_set_size_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_xapian_search_conf_t, index_memory),
+        NULL
+    }, {
+        ngx_string("xapian_body_positions"),
+        NGX_CONF_FLAG|NGX_HTTP_LOC_CONF,
+        ngx_conf_set_flag_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_xapian_search_conf_t, body_positions),
+        NULL
+    }, {
+        ngx_string("xapian_compact"),
+        NGX_CONF_FLAG|NGX_HTTP_LOC_CONF,
+        ngx_conf_set_flag_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_xapian_search_conf_t, compact),
+        NULL
+    }, {
+        ngx_string("xapian_language"),
+        NGX_CONF_TAKE1|NGX_HTTP_LOC_CONF,
+        ngx_conf_set_str_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_xapian_search_conf_t, language),
+        NULL
+    }, {
+        ngx_string("xapian_time_limit"),
+        NGX_CONF_TAKE1|NGX_HTTP_LOC_CONF,
+        ngx_conf_set_msec_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_xapian_search_conf_t, time_limit),
+        NULL
+    }, {
+        ngx_string("xapian_cache"),
+        NGX_CONF_TAKE1|NGX_HTTP_MAIN_CONF,
+        ngx_xapian_search_cache,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        0,
+        NULL
     },
+#if (NGX_THREADS)
+    {
+        ngx_string("xapian_thread_pool"),
+        NGX_CONF_TAKE1|NGX_HTTP_LOC_CONF,
+        ngx_xapian_search_thread_pool,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+#endif
     ngx_null_command
 };
 
 
 static ngx_http_module_t ngx_xapian_search_module_ctx = {
-    NULL, /* preconfiguration */
+    ngx_xapian_search_add_variables, /* preconfiguration */
     ngx_xapian_search_init, /* postconfiguration */
 
-    NULL, /* create main configuration */
+    ngx_xapian_search_create_main_conf, /* create main configuration */
     NULL, /* init main configuration */
 
     NULL, /* create server configuration */
@@ -93,26 +300,414 @@ ngx_module_t  ngx_xapian_search_module = {
     ngx_xapian_search_commands,                      /* module directives */
     NGX_HTTP_MODULE,                       /* module type */
     NULL,                                  /* init master */
-    NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_xapian_search_init_module,         /* init module */
+    ngx_xapian_search_init_process,        /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
-    NULL,                                  /* exit process */
+    ngx_xapian_search_exit_process,        /* exit process */
     NULL,                                  /* exit master */
     NGX_MODULE_V1_PADDING
 };
 
-struct ngx_xapian_chunk_handler_data_t {
-    char* dst;
-    unsigned int offset;
-};
+static void ngx_xapian_search_release_template(void *data) {
+    ngx_xapian_search_compiled_template_t* compiled = (ngx_xapian_search_compiled_template_t*)data;
+    if (--compiled->references == 0) {
+        ngx_xapian_free_template(compiled->contents);
+        ngx_free(compiled);
+    }
+}
+
+static void ngx_xapian_search_free_template(void *data) {
+    ngx_xapian_search_template_t* tmpl = (ngx_xapian_search_template_t*)data;
+    if (tmpl->compiled)
+        ngx_xapian_search_release_template(tmpl->compiled);
+    tmpl->compiled = NULL;
+}
+
+/* (re)compiles the template from its file; if that fails, whatever was compiled before stays current. This runs on the event loop, so
+   it's only a stat until the file's actually changed. */
+static ngx_int_t ngx_xapian_search_load_template(ngx_xapian_search_template_t* tmpl, ngx_log_t *log) {
+    ngx_file_info_t info;
+    const char* path = (const char*)tmpl->path.data;
+
+    tmpl->checked = ngx_current_msec;
+    if (ngx_file_info(path, &info) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_errno, "Can't find xapian template: %s", path);
+        return NGX_ERROR;
+    }
+    if (tmpl->compiled && ngx_file_mtime(&info) == tmpl->mtime && ngx_file_size(&info) == tmpl->size)
+        return NGX_OK;
+    /* what's read is whatever's there once it's open, which may have changed again since. */
+    FILE* file = fopen(path, "rb");
+    if (!file || ngx_fd_info(fileno(file), &info) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_errno, "Can't find xapian template: %s", path);
+        if (file)
+            fclose(file);
+        return NGX_ERROR;
+    }
+    size_t buffer_length = ngx_file_size(&info);
+    char* buffer = (char*)ngx_alloc(buffer_length+1, log);
+    if (buffer == NULL || fread(buffer, 1, buffer_length, file) != buffer_length) {
+        fclose(file);
+        if (buffer)
+            ngx_free(buffer);
+        ngx_log_error(NGX_LOG_ERR, log, 0, "Error reading xapian template: %s", path);
+        return NGX_ERROR;
+    }
+    fclose(file);
+    ngx_xapian_search_compiled_template_t* compiled = (ngx_xapian_search_compiled_template_t*)ngx_alloc(sizeof(ngx_xapian_search_compiled_template_t), log);
+    if (compiled == NULL) {
+        ngx_free(buffer);
+        return NGX_ERROR;
+    }
+    compiled->contents = ngx_xapian_parse_template(buffer, buffer_length);
+    ngx_free(buffer);
+    if (!compiled->contents) {
+        ngx_log_error(NGX_LOG_ERR, log, 0, "Error reading xapian template %s: %s", path, ngx_xapian_get_error());
+        ngx_free(compiled);
+        return NGX_ERROR;
+    }
+    compiled->references = 1;
+    ngx_xapian_search_free_template(tmpl);
+    tmpl->compiled = compiled;
+    tmpl->mtime = ngx_file_mtime(&info);
+    tmpl->size = ngx_file_size(&info);
+    ngx_log_error(NGX_LOG_INFO, log, 0, "Succesfully parsed xapian search template %s.", path);
+    return NGX_OK;
+}
 
+/* the template to render this request with, checking first whether the file's changed, if it's been long enough since last time. The
+   request keeps hold of it until it's done, even if it's replaced in the meantime. */
+static ngx_xapian_search_compiled_template_t* ngx_xapian_search_acquire_template(ngx_http_request_t *r, ngx_xapian_search_conf_t *config) {
+    ngx_xapian_search_template_t* tmpl = config->tmpl_contents;
+
+    if (config->tmpl_check_interval > 0 && (ngx_msec_int_t)(ngx_current_msec - tmpl->checked) >= (ngx_msec_int_t)config->tmpl_check_interval)
+        ngx_xapian_search_load_template(tmpl, r->connection->log);
+    ngx_pool_cleanup_t* cleanup = ngx_pool_cleanup_add(r->pool, 0);
+    if (cleanup == NULL)
+        return NULL;
+    cleanup->handler = ngx_xapian_search_release_template;
+    cleanup->data = tmpl->compiled;
+    ++tmpl->compiled->references;
+    return tmpl->compiled;
+}
+
+/* a search may run on a thread, where the request's pool can't be touched, so the response is collected in malloc'd blocks, growing as
+   it goes, which are freed along with the pool. */
 static void ngx_xapian_chunk_handler(const char* chunk, unsigned int chunk_size, void* data) {
-    ngx_xapian_chunk_handler_data_t* handler_data = (ngx_xapian_chunk_handler_data_t*)data;
-    memcpy(&handler_data->dst[handler_data->offset], chunk, chunk_size);
-    handler_data->offset += chunk_size;
+    ngx_xapian_search_ctx_t* ctx = (ngx_xapian_search_ctx_t*)data;
+    ngx_xapian_search_block_t* block = ctx->last;
+
+    if (ctx->failed)
+        return;
+    if (block == NULL || block->size - block->used < chunk_size) {
+        size_t size = block ? ngx_min(block->size * 2, 64*1024) : 4*1024;
+        size = ngx_max(size, chunk_size);
+        block = (ngx_xapian_search_block_t*)malloc(offsetof(ngx_xapian_search_block_t, data) + size);
+        if (block == NULL) {
+            ngx_cpystrn(ctx->error, (u_char*)"out of memory", sizeof(ctx->error));
+            ctx->failed = 1;
+            return;
+        }
+        block->next = NULL;
+        block->size = size;
+        block->used = 0;
+        if (ctx->last)
+            ctx->last->next = block;
+        else
+            ctx->first = block;
+        ctx->last = block;
+    }
+    ngx_memcpy(block->data + block->used, chunk, chunk_size);
+    block->used += chunk_size;
+    ctx->length += chunk_size;
+}
+
+static void ngx_xapian_search_free_blocks(void *data) {
+    ngx_xapian_search_ctx_t* ctx = (ngx_xapian_search_ctx_t*)data;
+    ngx_xapian_search_block_t* next;
+
+    for (ngx_xapian_search_block_t* block = ctx->first; block; block = next) {
+        next = block->next;
+        free(block);
+    }
+    ctx->first = ctx->last = NULL;
+}
+
+
+static void ngx_xapian_search_cache_insert_value(ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel) {
+    ngx_rbtree_node_t **p;
+    ngx_xapian_search_cache_node_t *n, *t;
+
+    /* ordered by hash, and then by the key itself, for the rare collision. */
+    for ( ;; ) {
+        if (node->key != temp->key) {
+            p = (node->key < temp->key) ? &temp->left : &temp->right;
+        } else {
+            n = (ngx_xapian_search_cache_node_t*)node;
+            t = (ngx_xapian_search_cache_node_t*)temp;
+            p = (n->key_len != t->key_len ? n->key_len < t->key_len : ngx_memcmp(n->data, t->data, n->key_len) < 0) ? &temp->left : &temp->right;
+        }
+        if (*p == sentinel)
+            break;
+        temp = *p;
+    }
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+static ngx_xapian_search_cache_node_t* ngx_xapian_search_cache_find(ngx_xapian_search_cache_t *cache, uint32_t hash, ngx_str_t *key) {
+    ngx_rbtree_node_t *node = cache->sh->rbtree.root, *sentinel = cache->sh->rbtree.sentinel;
+    ngx_xapian_search_cache_node_t *n;
+    ngx_int_t rc;
+
+    while (node != sentinel) {
+        if (hash != node->key) {
+            node = (hash < node->key) ? node->left : node->right;
+            continue;
+        }
+        n = (ngx_xapian_search_cache_node_t*)node;
+        rc = key->len != n->key_len ? (key->len < n->key_len ? -1 : 1) : ngx_memcmp(key->data, n->data, key->len);
+        if (rc == 0)
+            return n;
+        node = rc < 0 ? node->left : node->right;
+    }
+    return NULL;
+}
+
+static void ngx_xapian_search_cache_remove(ngx_xapian_search_cache_t *cache, ngx_xapian_search_cache_node_t *n) {
+    ngx_queue_remove(&n->queue);
+    ngx_rbtree_delete(&cache->sh->rbtree, &n->node);
+    ngx_slab_free_locked(cache->shpool, n);
+}
+
+/* returns a copy of the cached response, if there is one for this revision of the index. */
+static ngx_buf_t* ngx_xapian_search_cache_lookup(ngx_http_request_t *r, ngx_xapian_search_cache_t *cache, ngx_str_t *key, unsigned long long revision) {
+    uint32_t hash = ngx_crc32_short(key->data, key->len);
+    ngx_buf_t *buffer = NULL;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_xapian_search_cache_node_t *n = ngx_xapian_search_cache_find(cache, hash, key);
+    if (n && n->revision != revision) {
+        ngx_xapian_search_cache_remove(cache, n);
+        n = NULL;
+    }
+    if (n) {
+        /* copied out, as the entry can be evicted as soon as the lock's released. */
+        buffer = ngx_create_temp_buf(r->pool, ngx_max(n->body_len, 1));
+        if (buffer) {
+            buffer->last = ngx_cpymem(buffer->pos, n->data + n->key_len, n->body_len);
+            ngx_queue_remove(&n->queue);
+            ngx_queue_insert_head(&cache->sh->lru, &n->queue);
+            cache->sh->hits++;
+        }
+    }
+    if (!buffer)
+        cache->sh->misses++;
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+    return buffer;
+}
+
+static void ngx_xapian_search_cache_store(ngx_xapian_search_cache_t *cache, ngx_str_t *key, unsigned long long revision, ngx_chain_t *body, size_t body_len) {
+    uint32_t hash = ngx_crc32_short(key->data, key->len);
+    size_t size = offsetof(ngx_xapian_search_cache_node_t, data) + key->len + body_len;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_xapian_search_cache_node_t *n = ngx_xapian_search_cache_find(cache, hash, key);
+    if (n)
+        ngx_xapian_search_cache_remove(cache, n);
+    /* make room by evicting the least recently used responses; give up if that's not enough, as the response must be huge. */
+    n = (ngx_xapian_search_cache_node_t*)ngx_slab_alloc_locked(cache->shpool, size);
+    for (int evicted = 0; n == NULL && evicted < 16 && !ngx_queue_empty(&cache->sh->lru); ++evicted) {
+        ngx_queue_t *last = ngx_queue_last(&cache->sh->lru);
+        ngx_xapian_search_cache_remove(cache, ngx_queue_data(last, ngx_xapian_search_cache_node_t, queue));
+        n = (ngx_xapian_search_cache_node_t*)ngx_slab_alloc_locked(cache->shpool, size);
+    }
+    if (n) {
+        n->node.key = hash;
+        n->revision = revision;
+        n->key_len = key->len;
+        n->body_len = body_len;
+        ngx_memcpy(n->data, key->data, key->len);
+        u_char *p = n->data + key->len;
+        for (ngx_chain_t *cl = body; cl; cl = cl->next)
+            p = ngx_cpymem(p, cl->buf->pos, cl->buf->last - cl->buf->pos);
+        ngx_rbtree_insert(&cache->sh->rbtree, &n->node);
+        ngx_queue_insert_head(&cache->sh->lru, &n->queue);
+    }
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+/* everything a response depends on, other than the index's revision; that's the template, for html, as well as the arguments. Whitespace
+   in the decoded query is collapsed, but case is kept, as it changes how xapian parses a query. */
+static ngx_int_t ngx_xapian_search_cache_key(ngx_http_request_t *r, ngx_str_t *key, ngx_str_t *language, const char *index, ngx_xapian_search_template_t *tmpl, ngx_int_t results, ngx_int_t page, u_char *query) {
+    size_t index_len = ngx_strlen(index), query_len = ngx_strlen(query), tmpl_len = tmpl ? tmpl->path.len + NGX_TIME_T_LEN + NGX_OFF_T_LEN + 3 : 0;
+    u_char *p = (u_char*)ngx_pnalloc(r->pool, 1 + language->len + index_len + tmpl_len + 2 * NGX_INT_T_LEN + query_len + 5);
+    if (p == NULL)
+        return NGX_ERROR;
+    key->data = p;
+    *p++ = tmpl ? 'h' : 'j';
+    p = ngx_cpymem(p, language->data, language->len);
+    *p++ = 0;
+    p = ngx_cpymem(p, index, index_len);
+    if (tmpl)
+        p = ngx_sprintf(p, "%c%V%c%T%c%O", 0, &tmpl->path, 0, tmpl->mtime, 0, tmpl->size);
+    p = ngx_sprintf(p, "%c%i%c%i%c", 0, results, 0, page, 0);
+    u_char *start = p;
+    for (size_t i = 0; i < query_len; ++i) {
+        if (query[i] == ' ' || query[i] == '\t' || query[i] == '\r' || query[i] == '\n') {
+            if (p > start && p[-1] != ' ')
+                *p++ = ' ';
+        } else {
+            *p++ = query[i];
+        }
+    }
+    if (p > start && p[-1] == ' ')
+        --p;
+    key->len = p - key->data;
+    return NGX_OK;
+}
+
+static ngx_int_t ngx_xapian_search_init_cache_zone(ngx_shm_zone_t *shm_zone, void *data) {
+    ngx_xapian_search_cache_t *cache = (ngx_xapian_search_cache_t*)shm_zone->data, *previous = (ngx_xapian_search_cache_t*)data;
+
+    /* on reload, keep what's already cached; entries carry the index revision they were made from, so nothing stale is served. */
+    if (previous) {
+        cache->sh = previous->sh;
+        cache->shpool = previous->shpool;
+        return NGX_OK;
+    }
+    cache->shpool = (ngx_slab_pool_t*)shm_zone->shm.addr;
+    if (shm_zone->shm.exists) {
+        cache->sh = (ngx_xapian_search_cache_sh_t*)cache->shpool->data;
+        return NGX_OK;
+    }
+    cache->sh = (ngx_xapian_search_cache_sh_t*)ngx_slab_alloc(cache->shpool, sizeof(ngx_xapian_search_cache_sh_t));
+    if (cache->sh == NULL)
+        return NGX_ERROR;
+    cache->shpool->data = cache->sh;
+    ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel, ngx_xapian_search_cache_insert_value);
+    ngx_queue_init(&cache->sh->lru);
+    cache->sh->hits = 0;
+    cache->sh->misses = 0;
+    cache->shpool->log_nomem = 0;
+    return NGX_OK;
+}
+
+static char* ngx_xapian_search_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_xapian_search_main_conf_t *mcf = (ngx_xapian_search_main_conf_t*)conf;
+    ngx_str_t *value = (ngx_str_t*)cf->args->elts;
+    ngx_str_t name = ngx_string("xapian_search_cache");
+
+    if (mcf->cache_zone)
+        return (char*)"is duplicate";
+    ssize_t size = ngx_parse_size(&value[1]);
+    if (size == NGX_ERROR || size < (ssize_t)(8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid xapian_cache size \"%V\"", &value[1]);
+        return (char*)NGX_CONF_ERROR;
+    }
+    ngx_xapian_search_cache_t *cache = (ngx_xapian_search_cache_t*)ngx_pcalloc(cf->pool, sizeof(ngx_xapian_search_cache_t));
+    if (cache == NULL)
+        return (char*)NGX_CONF_ERROR;
+    mcf->cache_zone = ngx_shared_memory_add(cf, &name, size, &ngx_xapian_search_module);
+    if (mcf->cache_zone == NULL)
+        return (char*)NGX_CONF_ERROR;
+    mcf->cache_zone->init = ngx_xapian_search_init_cache_zone;
+    mcf->cache_zone->data = cache;
+    return NGX_CONF_OK;
 }
 
+static ngx_int_t ngx_xapian_search_cache_status_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data) {
+    static ngx_str_t statuses[] = { ngx_string("BYPASS"), ngx_string("MISS"), ngx_string("HIT") };
+    ngx_xapian_search_ctx_t *ctx = (ngx_xapian_search_ctx_t*)ngx_http_get_module_ctx(r, ngx_xapian_search_module);
+
+    if (ctx == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+    v->len = statuses[ctx->cache_status].len;
+    v->data = statuses[ctx->cache_status].data;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    return NGX_OK;
+}
+
+/* data is the offset of the counter within ngx_xapian_search_cache_sh_t. */
+static ngx_int_t ngx_xapian_search_cache_count_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data) {
+    ngx_xapian_search_main_conf_t *mcf = (ngx_xapian_search_main_conf_t*)ngx_http_get_module_main_conf(r, ngx_xapian_search_module);
+
+    if (mcf->cache_zone == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+    ngx_xapian_search_cache_t *cache = (ngx_xapian_search_cache_t*)mcf->cache_zone->data;
+    u_char *p = (u_char*)ngx_pnalloc(r->pool, NGX_ATOMIC_T_LEN);
+    if (p == NULL)
+        return NGX_ERROR;
+    v->len = ngx_sprintf(p, "%uA", *(ngx_atomic_uint_t*)((u_char*)cache->sh + data)) - p;
+    v->data = p;
+    v->valid = 1;
+    v->no_cacheable = 1;
+    v->not_found = 0;
+    return NGX_OK;
+}
+
+static ngx_http_variable_t ngx_xapian_search_variables[] = {
+    { ngx_string("xapian_cache_status"), NULL, ngx_xapian_search_cache_status_variable, 0, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+    { ngx_string("xapian_cache_hits"), NULL, ngx_xapian_search_cache_count_variable, offsetof(ngx_xapian_search_cache_sh_t, hits), NGX_HTTP_VAR_NOCACHEABLE, 0 },
+    { ngx_string("xapian_cache_misses"), NULL, ngx_xapian_search_cache_count_variable, offsetof(ngx_xapian_search_cache_sh_t, misses), NGX_HTTP_VAR_NOCACHEABLE, 0 },
+    ngx_http_null_variable
+};
+
+static ngx_int_t ngx_xapian_search_add_variables(ngx_conf_t *cf) {
+    for (ngx_http_variable_t *v = ngx_xapian_search_variables; v->name.len; ++v) {
+        ngx_http_variable_t *var = ngx_http_add_variable(cf, &v->name, v->flags);
+        if (var == NULL)
+            return NGX_ERROR;
+        var->get_handler = v->get_handler;
+        var->data = v->data;
+    }
+    return NGX_OK;
+}
+
+#if (NGX_THREADS)
+static char* ngx_xapian_search_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_xapian_search_conf_t *lcf = (ngx_xapian_search_conf_t*)conf;
+    ngx_str_t *value = (ngx_str_t*)cf->args->elts;
+
+    if (lcf->thread_pool != NGX_CONF_UNSET_PTR)
+        return (char*)"is duplicate";
+    /* much like aio threads=; "off" turns it back off for a location that'd otherwise inherit it. */
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        lcf->thread_pool = NULL;
+        return NGX_CONF_OK;
+    }
+    lcf->thread_pool = ngx_thread_pool_add(cf, &value[1]);
+    if (lcf->thread_pool == NULL)
+        return (char*)NGX_CONF_ERROR;
+    return NGX_CONF_OK;
+}
+#endif
+
+static ngx_str_t ngx_xapian_search_str(const char* str) {
+    ngx_str_t value = { ngx_strlen(str), (u_char*)str };
+    return value;
+}
+
+static ngx_table_elt_t* ngx_xapian_search_add_header(ngx_http_request_t *r, ngx_str_t key, ngx_str_t value) {
+    ngx_table_elt_t* header = (ngx_table_elt_t*)ngx_list_push(&r->headers_out.headers);
+    if (header == NULL)
+        return NULL;
+    header->hash = 1;
+    header->next = NULL;
+    header->key = key;
+    header->value = value;
+    return header;
+}
 
 static ngx_table_elt_t* search_hashed_headers_in(ngx_http_request_t *r, u_char *name, size_t len) {
     ngx_http_core_main_conf_t  *cmcf;
@@ -172,11 +767,98 @@ static ngx_table_elt_t* search_hashed_headers_in(ngx_http_request_t *r, u_char *
     return *((ngx_table_elt_t **) ((char *) &r->headers_in + hh->offset));
 }
 
-static ngx_int_t ngx_xapian_search_handler(ngx_http_request_t *r) {
-    u_char          *p, *ampersand, *equal, *last;
+/* runs the search itself; called either on the event loop, or on a thread pool, so mustn't touch the request or its pool. */
+static void ngx_xapian_search_run(ngx_xapian_search_ctx_t *ctx) {
+    int rc;
+    ngx_xapian_query_t query;
+
+    ngx_xapian_query_init(&query);
+    query.query = (const char*)ctx->query;
+    /* bounded by NGX_XAPIAN_SEARCH_MAX_OFFSET when the arguments were read. */
+    query.offset = (int)((ctx->page - 1) * ctx->results);
+    query.max_results = ctx->results;
+    query.time_limit = ctx->time_limit / 1000.0;
+    query.language = ctx->filter;
+    if (ctx->json)
+        rc = ngx_xapian_query_index_json(ctx->index, ctx->language, &query, ngx_xapian_chunk_handler, ctx);
+    else
+        rc = ngx_xapian_query_index_template(ctx->index, ctx->language, &query, ctx->tmpl->contents, ngx_xapian_chunk_handler, ctx);
+    if (rc < 0) {
+        const char* error = ngx_xapian_get_error();
+        ngx_cpystrn(ctx->error, (u_char*)(error ? error : "unknown error"), sizeof(ctx->error));
+        ctx->failed = 1;
+    }
+}
+
+static ngx_int_t ngx_xapian_search_send(ngx_http_request_t *r, ngx_xapian_search_ctx_t *ctx) {
     ngx_int_t       rc;
-    ngx_chain_t     out;
+    ngx_chain_t     **ll;
     ngx_buf_t       *buffer;
+
+    if (ctx->failed) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ngx_xapian_search failed: %s", ctx->error);
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    /* the blocks are sent as they are, one buffer each, without copying them again. */
+    if (ctx->cache_status != NGX_XAPIAN_CACHE_HIT) {
+        ll = &ctx->out;
+        for (ngx_xapian_search_block_t* block = ctx->first; block; block = block->next) {
+            if (block->used == 0)
+                continue;
+            buffer = ngx_calloc_buf(r->pool);
+            *ll = ngx_alloc_chain_link(r->pool);
+            if (buffer == NULL || *ll == NULL)
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            buffer->pos = buffer->start = block->data;
+            buffer->last = buffer->end = block->data + block->used;
+            buffer->memory = 1;
+            (*ll)->buf = buffer;
+            ll = &(*ll)->next;
+        }
+        *ll = NULL;
+        if (ctx->cache_status == NGX_XAPIAN_CACHE_MISS) {
+            ngx_xapian_search_main_conf_t* mcf = (ngx_xapian_search_main_conf_t*)ngx_http_get_module_main_conf(r, ngx_xapian_search_module);
+            ngx_xapian_search_cache_store((ngx_xapian_search_cache_t*)mcf->cache_zone->data, &ctx->cache_key, ctx->revision, ctx->out, ctx->length);
+        }
+    }
+    r->headers_out.content_length_n = ctx->length;
+
+    /* Send off headers. */
+    rc = ngx_http_send_header(r);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only)
+        return rc;
+    if (ctx->out == NULL)
+        return ngx_http_send_special(r, NGX_HTTP_LAST);
+
+    /* Send off buffers. */
+    for (ngx_chain_t* cl = ctx->out; cl; cl = cl->next) {
+        if (cl->next == NULL)
+            cl->buf->last_buf = (r == r->main) ? 1 : 0;
+        cl->buf->last_in_chain = cl->next == NULL;
+    }
+	return ngx_http_output_filter(r, ctx->out);
+}
+
+#if (NGX_THREADS)
+static void ngx_xapian_search_thread_handler(void *data, ngx_log_t *log) {
+    ngx_xapian_search_run(*(ngx_xapian_search_ctx_t**)data);
+}
+
+static void ngx_xapian_search_thread_event_handler(ngx_event_t *ev) {
+    ngx_http_request_t *r = (ngx_http_request_t*)ev->data;
+    ngx_connection_t *c = r->connection;
+    ngx_xapian_search_ctx_t *ctx = (ngx_xapian_search_ctx_t*)ngx_http_get_module_ctx(r, ngx_xapian_search_module);
+
+    r->main->blocked--;
+    r->aio = 0;
+    ngx_http_finalize_request(r, ngx_xapian_search_send(r, ctx));
+    ngx_http_run_posted_requests(c);
+}
+#endif
+
+static ngx_int_t ngx_xapian_search_handler(ngx_http_request_t *r) {
+    u_char          *p, *ampersand, *equal, *last, *dst;
+    size_t          length;
 	ngx_xapian_search_conf_t *config;
 
 	config = (ngx_xapian_search_conf_t*)ngx_http_get_module_loc_conf(r, ngx_xapian_search_module);
@@ -188,93 +870,196 @@ static ngx_int_t ngx_xapian_search_handler(ngx_http_request_t *r) {
 	if (!(r->method & NGX_HTTP_GET))
         return NGX_HTTP_NOT_ALLOWED;
 
-    unsigned char query[1024] = "";
+    ngx_xapian_search_ctx_t* ctx = (ngx_xapian_search_ctx_t*)ngx_pcalloc(r->pool, sizeof(ngx_xapian_search_ctx_t));
+    if (ctx == NULL)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    ngx_http_set_ctx(r, ctx, ngx_xapian_search_module);
+
+    ctx->index = (const char*)config->index.data;
+    ctx->language = (const char*)config->language.data;
+    ctx->results = NGX_XAPIAN_SEARCH_DEFAULT_RESULTS;
+    ctx->page = 1;
+    ctx->time_limit = config->time_limit;
+    const char* index_path = ctx->index;
+
+    /* parse out q, results, page and language in one pass; 1k of characters of query should be enough for anybody. */
+    u_char* query = ctx->query;
     p = r->args.data;
     last = p + r->args.len;
-    for ( ; p < last; p++) {
+    for ( ; p < last; p = ampersand + 1) {
         ampersand = ngx_strlchr(p, last, '&');
         if (ampersand == NULL)
             ampersand = last;
-        equal = ngx_strlchr(p, last, '=');
-        if ((equal == NULL) || (equal > ampersand))
-            equal = ampersand;
+        equal = ngx_strlchr(p, ampersand, '=');
+        if (equal == NULL)
+            continue;
+        length = ampersand - (equal + 1);
         if (equal - p == 1 && p[0] == 'q') {
-            unsigned int length = ampersand - equal;
-            length = length > sizeof(query) ? sizeof(query) : length;
-            ngx_cpystrn(query, equal+1, length > sizeof(query) ? sizeof(query) : length);
-            query[length] = 0;
-            break;
+            length = ngx_min(length, sizeof(ctx->query) - 1);
+            dst = ngx_cpymem(query, equal + 1, length);
+            for (u_char* c = query; c < dst; ++c) {
+                if (*c == '+')
+                    *c = ' ';
+            }
+            /* decoded in place; never longer than the original. */
+            u_char* src = query;
+            dst = query;
+            ngx_unescape_uri(&dst, &src, length, 0);
+            *dst = 0;
+        } else if (equal - p == 7 && ngx_strncmp(p, "results", 7) == 0) {
+            ctx->results = ngx_atoi(equal + 1, length);
+            if (ctx->results < 1)
+                return NGX_HTTP_BAD_REQUEST;
+            ctx->results = ngx_min(ctx->results, NGX_XAPIAN_SEARCH_MAX_RESULTS);
+        } else if (equal - p == 4 && ngx_strncmp(p, "page", 4) == 0) {
+            ctx->page = ngx_atoi(equal + 1, length);
+            if (ctx->page < 1)
+                return NGX_HTTP_BAD_REQUEST;
+        } else if (equal - p == 8 && ngx_strncmp(p, "language", 8) == 0 && length > 0) {
+            if (length >= sizeof(ctx->language_buffer) - 1)
+                return NGX_HTTP_BAD_REQUEST;
+            /* decoded in place, just as the query is, so that the filter, and the cache key, are the same however it was escaped. */
+            ctx->language_buffer[0] = '=';
+            dst = ngx_cpymem(ctx->language_buffer + 1, equal + 1, length);
+            u_char* src = ctx->language_buffer + 1;
+            dst = ctx->language_buffer + 1;
+            ngx_unescape_uri(&dst, &src, length, 0);
+            *dst = 0;
+            ctx->filter = ctx->language_buffer[1] ? (const char*)ctx->language_buffer + 1 : NULL;
         }
     }
+    /* deep pages cost as much as fetching everything before them; past a point, they're refused. The page is bounded by division, as it
+       can be anything ngx_atoi accepts, and the product would overflow. */
+    if (ctx->page - 1 > (NGX_XAPIAN_SEARCH_MAX_OFFSET - 1) / ctx->results)
+        return NGX_HTTP_BAD_REQUEST;
+    /* the query's stemmed in the language it's restricted to, where there's a stemmer for it; the filter alone decides what's returned. */
+    ngx_str_t language = config->language;
+    if (ctx->filter) {
+        if (ngx_xapian_prepare_language(ctx->filter) == 0)
+            ctx->language = ctx->filter;
+        else
+            ngx_xapian_clear_error();
+        language.data = ctx->language_buffer;
+        language.len = ngx_strlen(ctx->language_buffer);
+    }
 
-    char path[PATH_MAX];
-    memcpy(path, config->index.data, config->index.len);
-    path[config->index.len] = 0;
-
-    const char* index_path = path;
+    /* the index is built in the background; until the first build finishes, there's nothing to search. */
+    if (access(index_path, F_OK) != 0) {
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "xapian index %s has not been built yet", index_path);
+        return NGX_HTTP_SERVICE_UNAVAILABLE;
+    }
     r->headers_out.status = NGX_HTTP_OK;
 
     ngx_table_elt_t* accept = search_hashed_headers_in(r, (unsigned char*)"accept", 6);
-    if (accept && ngx_strstr(accept->value.data, "json")) {
-        /* set all headers ahead of time. */
-        r->headers_out.content_type.len = sizeof("application/json; charset=UTF-8") - 1;
-        r->headers_out.content_type.data = (u_char*)"application/json; charset=UTF-8";
-        /* parse out the q= query parameter, into the query buffer; 1k of characters should be enough for anybody. */
-        /* 100k should be enough for anyone. (for now) */
-        buffer = ngx_create_temp_buf(r->pool, 100*1024);
-        if (buffer == NULL) {
-            ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
-            return NGX_HTTP_INTERNAL_SERVER_ERROR;
-        }
-        ngx_xapian_chunk_handler_data_t handler_data = { (char*)buffer->pos, 0 };
-        ngx_log_error(NGX_LOG_INFO, r->connection->log, 0, "searching for term %s in index %s, as json", query, index_path);
-        int total_length = ngx_xapian_search_index_json(index_path, "en", (char*)query, 12, ngx_xapian_chunk_handler, &handler_data);
-        if (total_length < 0) {
-            ngx_log_error(NGX_LOG_ERR, r->connection->log, ngx_errno, "ngx_xapian_search failed: %s", ngx_xapian_get_error());
-            ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+    ctx->json = accept && ngx_strstr(accept->value.data, "json");
+    if (!ctx->json) {
+        if (!config->tmpl_contents)
+            return NGX_HTTP_NOT_ALLOWED;
+        ctx->tmpl = ngx_xapian_search_acquire_template(r, config);
+        if (ctx->tmpl == NULL)
             return NGX_HTTP_INTERNAL_SERVER_ERROR;
-        }
-        buffer->pos[total_length] = 0;
+    }
 
-        buffer->last = buffer->pos + total_length;
-        buffer->last_buf = 1;
-        r->headers_out.content_length_n = total_length;
+    /* set all headers ahead of time. */
+    if (ctx->json) {
+        r->headers_out.content_type.len = sizeof("application/json; charset=UTF-8") - 1;
+        r->headers_out.content_type.data = (u_char*)"application/json; charset=UTF-8";
     } else {
-        if (!config->tmpl_contents)
-            return NGX_HTTP_NOT_ALLOWED;
         r->headers_out.content_type.len = sizeof("text/html; charset=UTF-8") - 1;
         r->headers_out.content_type.data = (u_char*)"text/html; charset=UTF-8";
-        buffer = ngx_create_temp_buf(r->pool, 100*1024);
-        if (buffer == NULL) {
-            ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
-            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    /* everything in the response follows from the arguments, the index, and the template; the cache key identifies the first and last. */
+    ngx_http_core_loc_conf_t* clcf = (ngx_http_core_loc_conf_t*)ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+    ngx_xapian_search_main_conf_t* mcf = (ngx_xapian_search_main_conf_t*)ngx_http_get_module_main_conf(r, ngx_xapian_search_module);
+    ngx_flag_t revisioned = 0;
+    if (mcf->cache_zone || clcf->etag) {
+        if (ngx_xapian_get_revision(index_path, ctx->language, &ctx->revision, &ctx->modified) != 0) {
+            /* the search itself will fail the same way, and report it. */
+            ngx_xapian_clear_error();
+        } else if (ngx_xapian_search_cache_key(r, &ctx->cache_key, &language, index_path, ctx->json ? NULL : config->tmpl_contents, ctx->results, ctx->page, query) == NGX_OK) {
+            if (!ctx->json)
+                ctx->modified = ngx_max(ctx->modified, config->tmpl_contents->mtime);
+            revisioned = 1;
         }
-        ngx_xapian_chunk_handler_data_t handler_data = { (char*)buffer->pos, 0 };
-        ngx_log_error(NGX_LOG_INFO, r->connection->log, 0, "searching for term %s in index as html", query);
-        int total_results = ngx_xapian_search_template(index_path, "en", (char*)query, 12, config->tmpl_contents, ngx_xapian_chunk_handler, &handler_data);
-        if (total_results < 0) {
-            ngx_log_error(NGX_LOG_ERR, r->connection->log, ngx_errno, "ngx_xapian_search failed: %s", ngx_xapian_get_error());
-            ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+    }
+    /* the response varies with Accept, as that picks between json and html. */
+    if (ngx_xapian_search_add_header(r, ngx_xapian_search_str("Vary"), ngx_xapian_search_str("Accept")) == NULL)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    if (config->cache_control.len > 0 && ngx_xapian_search_add_header(r, ngx_xapian_search_str("Cache-Control"), config->cache_control) == NULL)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    if (revisioned && clcf->etag) {
+        /* the key's hash covers the template's path as well as the arguments; its mtime and size are spelled out, as is the revision. */
+        u_char* etag = (u_char*)ngx_pnalloc(r->pool, 2 + 8 + 1 + 16 + 2 * (1 + 16));
+        if (etag == NULL)
             return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        u_char* last = ngx_sprintf(etag, "\"%08xD-%016uxL", ngx_crc32_long(ctx->cache_key.data, ctx->cache_key.len), ctx->revision);
+        if (!ctx->json)
+            last = ngx_sprintf(last, "-%uxL-%uxL", (uint64_t)config->tmpl_contents->mtime, (uint64_t)config->tmpl_contents->size);
+        *last++ = '"';
+        ngx_str_t value = { (size_t)(last - etag), etag };
+        r->headers_out.etag = ngx_xapian_search_add_header(r, ngx_xapian_search_str("ETag"), value);
+        if (r->headers_out.etag == NULL)
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        r->headers_out.last_modified_time = ctx->modified;
+        /* a client or cache that already has this exact response doesn't need to wait for a search to find out. */
+        ngx_table_elt_t* if_none_match = r->headers_in.if_none_match;
+        if (if_none_match && ngx_xapian_etag_matches((const char*)if_none_match->value.data, if_none_match->value.len, (const char*)value.data, value.len)) {
+            r->headers_out.status = NGX_HTTP_NOT_MODIFIED;
+            r->headers_out.content_type.len = 0;
+            r->headers_out.content_type.data = NULL;
+            r->headers_out.content_length_n = -1;
+            r->header_only = 1;
+            return ngx_http_send_header(r);
         }
-        buffer->pos[handler_data.offset] = 0;
+    }
 
-        buffer->last = buffer->pos + handler_data.offset;
-        buffer->last_buf = 1;
-        r->headers_out.content_length_n = handler_data.offset;
+    /* popular searches are answered straight out of the shared cache, as long as the index hasn't changed since. */
+    if (mcf->cache_zone && revisioned) {
+        ngx_buf_t* buffer = ngx_xapian_search_cache_lookup(r, (ngx_xapian_search_cache_t*)mcf->cache_zone->data, &ctx->cache_key, ctx->revision);
+        ctx->cache_status = buffer ? NGX_XAPIAN_CACHE_HIT : NGX_XAPIAN_CACHE_MISS;
+        if (buffer && buffer->last > buffer->pos) {
+            ctx->out = ngx_alloc_chain_link(r->pool);
+            if (ctx->out == NULL)
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            ctx->out->buf = buffer;
+            ctx->out->next = NULL;
+            ctx->length = buffer->last - buffer->pos;
+        }
+    }
+    if (ctx->cache_status == NGX_XAPIAN_CACHE_HIT) {
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, 0, "found term %s in index %s in cache", query, index_path);
+        return ngx_xapian_search_send(r, ctx);
     }
 
-    /* Send off headers. */
-    rc = ngx_http_send_header(r);
-    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
-        ngx_http_finalize_request(r, rc);
+    ngx_pool_cleanup_t* cleanup = ngx_pool_cleanup_add(r->pool, 0);
+    if (cleanup == NULL)
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    cleanup->handler = ngx_xapian_search_free_blocks;
+    cleanup->data = ctx;
+    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0, "searching for term %s in index %s, as %s", query, index_path, ctx->json ? "json" : "html");
+
+#if (NGX_THREADS)
+    /* a search that has to go to disk would otherwise hold up every other connection on this worker. */
+    if (config->thread_pool) {
+        ngx_thread_task_t *task = ngx_thread_task_alloc(r->pool, sizeof(ngx_xapian_search_ctx_t*));
+        if (task == NULL)
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        *(ngx_xapian_search_ctx_t**)task->ctx = ctx;
+        task->handler = ngx_xapian_search_thread_handler;
+        task->event.data = r;
+        task->event.handler = ngx_xapian_search_thread_event_handler;
+        if (ngx_thread_task_post(config->thread_pool, task) != NGX_OK)
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        r->main->blocked++;
+        r->aio = 1;
+        r->main->count++;
+        return NGX_DONE;
     }
+#endif
 
-    /* Send off buffer. */
-    out.buf = buffer;
-    out.next = NULL;
-	return ngx_http_output_filter(r, &out);
+    ngx_xapian_search_run(ctx);
+    return ngx_xapian_search_send(r, ctx);
 }
 
 
@@ -296,6 +1081,18 @@ static ngx_int_t ngx_xapian_search_init(ngx_conf_t *cf)
     return NGX_OK;
 }
 
+static void* ngx_xapian_search_create_main_conf(ngx_conf_t *cf) {
+    ngx_xapian_search_main_conf_t *mcf;
+    mcf = (ngx_xapian_search_main_conf_t*)ngx_pcalloc(cf->pool, sizeof(ngx_xapian_search_main_conf_t));
+    if (mcf == NULL)
+        return NULL;
+    if (ngx_array_init(&mcf->builds, cf->pool, 4, sizeof(ngx_xapian_search_conf_t*)) != NGX_OK)
+        return NULL;
+    if (ngx_array_init(&mcf->searchers, cf->pool, 4, sizeof(ngx_xapian_search_conf_t*)) != NGX_OK)
+        return NULL;
+    return mcf;
+}
+
 static void* ngx_xapian_search_create_loc_conf(ngx_conf_t *cf) {
 	ngx_xapian_search_conf_t *conf;
 	conf = (ngx_xapian_search_conf_t*)ngx_pcalloc(cf->pool, sizeof(ngx_xapian_search_conf_t));
@@ -303,14 +1100,49 @@ static void* ngx_xapian_search_create_loc_conf(ngx_conf_t *cf) {
 		return NGX_CONF_ERROR;
     conf->enabled = NGX_CONF_UNSET;
     conf->tmpl_contents = NULL;
+    conf->tmpl_check_interval = NGX_CONF_UNSET_MSEC;
+    conf->cache_control.len = 0;
+    conf->cache_control.data = NULL;
     conf->directory = NULL;
 	conf->index.len = 0;
 	conf->index.data = NULL;
 	conf->tmpl.len = 0;
 	conf->tmpl.data = NULL;
+    conf->index_threads = NGX_CONF_UNSET;
+    conf->body_positions = NGX_CONF_UNSET;
+    conf->compact = NGX_CONF_UNSET;
+    conf->index_docs_per_commit = NGX_CONF_UNSET;
+    conf->index_memory = NGX_CONF_UNSET_SIZE;
+    conf->language.len = 0;
+    conf->language.data = NULL;
+    conf->time_limit = NGX_CONF_UNSET_MSEC;
+#if (NGX_THREADS)
+    conf->thread_pool = (ngx_thread_pool_t*)NGX_CONF_UNSET_PTR;
+#endif
 	return conf;
 }
 
+/* whether every directory in one list, with its regex, is also in the other. */
+static ngx_flag_t ngx_xapian_search_directories_within(ngx_array_t *a, ngx_array_t *b) {
+    ngx_xapian_search_directory_t *left = (ngx_xapian_search_directory_t*)a->elts, *right = (ngx_xapian_search_directory_t*)b->elts;
+    for (ngx_uint_t i = 0; i < a->nelts; ++i) {
+        ngx_uint_t j;
+        for (j = 0; j < b->nelts; ++j) {
+            if (left[i].path.len == right[j].path.len && ngx_strncmp(left[i].path.data, right[j].path.data, left[i].path.len) == 0 &&
+                left[i].regex.len == right[j].regex.len && (left[i].regex.len == 0 || ngx_strncmp(left[i].regex.data, right[j].regex.data, left[i].regex.len) == 0))
+                break;
+        }
+        if (j == b->nelts)
+            return 0;
+    }
+    return 1;
+}
+
+/* whether two lists of directories build the same shards; as with the shards themselves, order and repetition don't matter. */
+static ngx_flag_t ngx_xapian_search_same_directories(ngx_array_t *a, ngx_array_t *b) {
+    return ngx_xapian_search_directories_within(a, b) && ngx_xapian_search_directories_within(b, a);
+}
+
 static char* ngx_xapian_search_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child) {
     ngx_http_core_loc_conf_t  *clcf;
 	ngx_xapian_search_conf_t *prev = (ngx_xapian_search_conf_t*)parent;
@@ -326,24 +1158,27 @@ static char* ngx_xapian_search_merge_loc_conf(ngx_conf_t *cf, void *parent, void
             if (prev->directory == NULL) {
                 if (clcf && clcf->root.data) {
                     int length = clcf->root.len;
-                    conf->directory = ngx_array_create(cf->pool, 1, sizeof(ngx_str_t));
-                    ngx_str_t* element = (ngx_str_t*)ngx_array_push(conf->directory);
-                    element->data = (unsigned char*)ngx_palloc(cf->pool, length+1);
-                    memcpy(element->data, clcf->root.data, length);
-                    element->data[length] = 0;
-                    element->len = length;
+                    conf->directory = ngx_array_create(cf->pool, 1, sizeof(ngx_xapian_search_directory_t));
+                    ngx_xapian_search_directory_t* element = (ngx_xapian_search_directory_t*)ngx_array_push(conf->directory);
+                    element->path.data = (unsigned char*)ngx_palloc(cf->pool, length+1);
+                    memcpy(element->path.data, clcf->root.data, length);
+                    element->path.data[length] = 0;
+                    element->path.len = length;
+                    element->regex.len = 0;
+                    element->regex.data = NULL;
                 }
             } else {
                 conf->directory = prev->directory;
             }
         }
-        if (!conf->directory || conf->directory->nelts == 0 || ((ngx_str_t*)conf->directory->elts)[0].data == NULL || ((ngx_str_t*)conf->directory->elts)[0].len == 0) {
+        ngx_xapian_search_directory_t* directories = conf->directory ? (ngx_xapian_search_directory_t*)conf->directory->elts : NULL;
+        if (!directories || conf->directory->nelts == 0 || directories[0].path.data == NULL || directories[0].path.len == 0) {
             ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "Requires a xapian_search directory to be specified, or a root directive.");
             return (char*)NGX_CONF_ERROR;
         }
         char index_buffer[PATH_MAX] = "";
-        memcpy(index_buffer, (const char*)((ngx_str_t*)conf->directory->elts)[0].data, ((ngx_str_t*)conf->directory->elts)[0].len+1);
-        index_buffer[((ngx_str_t*)conf->directory->elts)[0].len+2] = 0;
+        memcpy(index_buffer, (const char*)directories[0].path.data, directories[0].path.len+1);
+        index_buffer[directories[0].path.len+2] = 0;
         strcat(index_buffer, "/xapian_index");
         if (conf->index.data == NULL)  {
             if (prev->index.data != NULL) {
@@ -357,6 +1192,35 @@ static char* ngx_xapian_search_merge_loc_conf(ngx_conf_t *cf, void *parent, void
             }
         }
         ngx_conf_merge_str_value(conf->tmpl, prev->tmpl, "");
+        ngx_conf_merge_msec_value(conf->tmpl_check_interval, prev->tmpl_check_interval, 5000);
+        ngx_conf_merge_str_value(conf->cache_control, prev->cache_control, "");
+        ngx_conf_merge_value(conf->index_threads, prev->index_threads, 0);
+        ngx_conf_merge_value(conf->body_positions, prev->body_positions, 1);
+        ngx_conf_merge_value(conf->compact, prev->compact, 0);
+        ngx_conf_merge_value(conf->index_docs_per_commit, prev->index_docs_per_commit, 0);
+        ngx_conf_merge_size_value(conf->index_memory, prev->index_memory, 0);
+        ngx_conf_merge_str_value(conf->language, prev->language, "en");
+        ngx_conf_merge_msec_value(conf->time_limit, prev->time_limit, 0);
+#if (NGX_THREADS)
+        ngx_conf_merge_ptr_value(conf->thread_pool, prev->thread_pool, NULL);
+#endif
+
+        /* ngx_conf_set_num_slot takes any integer, sign and all; the builder only takes ints. */
+        if (conf->index_threads < 0 || conf->index_threads > INT_MAX) {
+            ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "Invalid xapian_index_threads %i; must be between 0 and %d.", conf->index_threads, INT_MAX);
+            return (char*)NGX_CONF_ERROR;
+        }
+        if (conf->index_docs_per_commit < 0 || conf->index_docs_per_commit > INT_MAX) {
+            ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "Invalid xapian_index_docs_per_commit %i; must be between 0 and %d.", conf->index_docs_per_commit, INT_MAX);
+            return (char*)NGX_CONF_ERROR;
+        }
+
+        /* catch a language with no stemmer now, rather than on every search. */
+        if (ngx_xapian_prepare_language((const char*)conf->language.data) != 0) {
+            ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "Unsupported xapian_language %s: %s", conf->language.data, ngx_xapian_get_error());
+            ngx_xapian_clear_error();
+            return (char*)NGX_CONF_ERROR;
+        }
 
         if (!conf->index.data || conf->index.len == 0) {
             ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "Requires a xapian_index directory to be specified.");
@@ -373,40 +1237,164 @@ static char* ngx_xapian_search_merge_loc_conf(ngx_conf_t *cf, void *parent, void
 
             int length = strlen(template_buffer);
             conf->tmpl.data = (unsigned char*)ngx_palloc(cf->pool, length+1);
-            memcpy(conf->index.data, index_buffer, length);
+            memcpy(conf->tmpl.data, template_buffer, length);
             conf->tmpl.data[length] = 0;
             conf->tmpl.len = length;
 
-            // Should most assuredly pre-parse this with a real template library, but for now, just replacing at runtime will have to do.
-            FILE* file = fopen(template_buffer, "rb");
-            if (!file) {
-                ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "Can't find xapian template: %s", template_buffer);
+            conf->tmpl_contents = (ngx_xapian_search_template_t*)ngx_pcalloc(cf->pool, sizeof(ngx_xapian_search_template_t));
+            if (conf->tmpl_contents == NULL)
                 return (char*)NGX_CONF_ERROR;
-            }
-            fseek(file, 0, SEEK_END);
-            size_t buffer_length = ftell(file);
-            fseek(file, 0, SEEK_SET);
-            char* buffer = (char*)ngx_palloc(cf->pool, buffer_length+1);
-            if (fread(buffer, 1, buffer_length, file) != buffer_length) {
-                fclose(file);
-                ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "Error reading xapian template: %s", template_buffer);
+            conf->tmpl_contents->path = conf->tmpl;
+            if (ngx_xapian_search_load_template(conf->tmpl_contents, cf->log) != NGX_OK)
                 return (char*)NGX_CONF_ERROR;
-            }
-            fclose(file);
-            conf->tmpl_contents = ngx_xapian_parse_template(buffer, buffer_length);
-            if (!conf->tmpl_contents) {
-                ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "Error reading xapian template %s: %s", template_buffer, ngx_xapian_get_error());
+            ngx_pool_cleanup_t* cleanup = ngx_pool_cleanup_add(cf->pool, 0);
+            if (cleanup == NULL)
                 return (char*)NGX_CONF_ERROR;
-            }
+            cleanup->handler = ngx_xapian_search_free_template;
+            cleanup->data = conf->tmpl_contents;
             ngx_conf_log_error(NGX_LOG_INFO, cf, 0, "Succesfully parsed xapian search template %s.", template_buffer);
         }
 
 
-        ngx_conf_log_error(NGX_LOG_INFO, cf, 0, "Building a xapian search index for %s at %s.", ((ngx_str_t*)conf->directory->elts)[0].data, index_buffer);
-        if (ngx_xapian_build_index((const char*)((ngx_str_t*)conf->directory->elts)[0].data, "en", (const char*)index_buffer, (const char*)(conf->directory->nelts == 2 ? ((ngx_str_t*)conf->directory->elts)[1].data : NULL)) == 0)
-            ngx_conf_log_error(NGX_LOG_INFO, cf, 0, "Succesfully built xapian search index for %s at %s.", ((ngx_str_t*)conf->directory->elts)[0].data, index_buffer);
-        else
-            ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "Failed to build xapian search index for %s at %s: %s.", ((ngx_str_t*)conf->directory->elts)[0].data, index_buffer, ngx_xapian_get_error());
+        /* the index itself is built by a helper process once the configuration has been loaded; see ngx_xapian_search_init_module. */
+        ngx_xapian_search_main_conf_t* mcf = (ngx_xapian_search_main_conf_t*)ngx_http_conf_get_module_main_conf(cf, ngx_xapian_search_module);
+        ngx_xapian_search_conf_t** builds = (ngx_xapian_search_conf_t**)mcf->builds.elts;
+        ngx_uint_t i;
+        for (i = 0; i < mcf->builds.nelts; ++i) {
+            if (builds[i]->index.len == conf->index.len && ngx_strncmp(builds[i]->index.data, conf->index.data, conf->index.len) == 0)
+                break;
+        }
+        /* an index is built once, however many locations search it, so they have to agree on what goes in it. */
+        if (i < mcf->builds.nelts && !ngx_xapian_search_same_directories(builds[i]->directory, conf->directory)) {
+            ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "xapian_index %V is already built from a different set of xapian_directory entries.", &conf->index);
+            return (char*)NGX_CONF_ERROR;
+        }
+        if (i == mcf->builds.nelts) {
+            ngx_xapian_search_conf_t** build = (ngx_xapian_search_conf_t**)ngx_array_push(&mcf->builds);
+            if (build == NULL)
+                return (char*)NGX_CONF_ERROR;
+            *build = conf;
+        }
+        ngx_xapian_search_conf_t** searchers = (ngx_xapian_search_conf_t**)mcf->searchers.elts;
+        for (i = 0; i < mcf->searchers.nelts; ++i) {
+            if (searchers[i]->index.len == conf->index.len && ngx_strncmp(searchers[i]->index.data, conf->index.data, conf->index.len) == 0 &&
+                searchers[i]->language.len == conf->language.len && ngx_strncmp(searchers[i]->language.data, conf->language.data, conf->language.len) == 0)
+                break;
+        }
+        if (i == mcf->searchers.nelts) {
+            ngx_xapian_search_conf_t** searcher = (ngx_xapian_search_conf_t**)ngx_array_push(&mcf->searchers);
+            if (searcher == NULL)
+                return (char*)NGX_CONF_ERROR;
+            *searcher = conf;
+        }
     }
 	return NGX_CONF_OK;
 }
+
+static void ngx_xapian_search_builder_process(ngx_cycle_t *cycle, void *data) {
+    ngx_xapian_search_main_conf_t *mcf = (ngx_xapian_search_main_conf_t*)data;
+    ngx_xapian_search_conf_t **builds = (ngx_xapian_search_conf_t**)mcf->builds.elts;
+    sigset_t set;
+
+    /* much like nginx's own cache loader; a helper that shouldn't hang on to anything belonging to the master. */
+    ngx_process = NGX_PROCESS_HELPER;
+    sigemptyset(&set);
+    sigprocmask(SIG_SETMASK, &set, NULL);
+    ngx_close_listening_sockets(cycle);
+    ngx_setproctitle((char*)"xapian index builder");
+
+    /* it parses arbitrary html, and the workers must be able to read and collect what it writes; so drop to their user, as ngx_worker_process_init does. */
+    if (geteuid() == 0) {
+        ngx_core_conf_t *ccf = (ngx_core_conf_t*)ngx_get_conf(cycle->conf_ctx, ngx_core_module);
+        if (setgid(ccf->group) == -1) {
+            ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno, "setgid(%d) failed", ccf->group);
+            exit(2);
+        }
+        if (initgroups(ccf->username, ccf->group) == -1) {
+            ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno, "initgroups(%s, %d) failed", ccf->username, ccf->group);
+            exit(2);
+        }
+        if (setuid(ccf->user) == -1) {
+            ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno, "setuid(%d) failed", ccf->user);
+            exit(2);
+        }
+    }
+
+    for (ngx_uint_t i = 0; i < mcf->builds.nelts; ++i) {
+        ngx_xapian_search_conf_t *conf = builds[i];
+        ngx_xapian_search_directory_t *directory = (ngx_xapian_search_directory_t*)conf->directory->elts;
+        ngx_uint_t count = conf->directory->nelts;
+        const char **paths = (const char**)ngx_palloc(cycle->pool, 2 * count * sizeof(const char*));
+        if (paths == NULL)
+            break;
+        const char **regexes = paths + count;
+        for (ngx_uint_t j = 0; j < count; ++j) {
+            paths[j] = (const char*)directory[j].path.data;
+            regexes[j] = directory[j].regex.len > 0 ? (const char*)directory[j].regex.data : NULL;
+        }
+        ngx_xapian_build_options_t build_options;
+        ngx_xapian_build_options_init(&build_options);
+        build_options.threads = conf->index_threads;
+        build_options.body_positions = conf->body_positions;
+        build_options.compact = conf->compact;
+        build_options.docs_per_commit = (int)conf->index_docs_per_commit;
+        build_options.memory_budget = conf->index_memory;
+        ngx_xapian_build_stats_t stats;
+        build_options.stats = &stats;
+        ngx_log_error(NGX_LOG_INFO, cycle->log, 0, "Building a xapian search index for %s (%ui directories) at %s.", paths[0], count, conf->index.data);
+        if (ngx_xapian_build_shards(paths, regexes, (int)count, (const char*)conf->language.data, (const char*)conf->index.data, &build_options) != 0) {
+            ngx_log_error(NGX_LOG_ERR, cycle->log, 0, "Failed to build xapian search index for %s at %s: %s.", paths[0], conf->index.data, ngx_xapian_get_error());
+            continue;
+        }
+        if (stats.skipped > 0)
+            ngx_log_error(NGX_LOG_WARN, cycle->log, 0, "Skipped %uL files that disappeared while building xapian search index for %s at %s.", stats.skipped, paths[0], conf->index.data);
+        if (conf->compact)
+            ngx_log_error(NGX_LOG_INFO, cycle->log, 0, "Succesfully built xapian search index for %s at %s: %uL documents in %uLms, %uL bytes compacted to %uL.",
+                paths[0], conf->index.data, stats.documents, stats.milliseconds, stats.size, stats.compacted_size);
+        else
+            ngx_log_error(NGX_LOG_INFO, cycle->log, 0, "Succesfully built xapian search index for %s at %s: %uL documents in %uLms, %uL bytes.",
+                paths[0], conf->index.data, stats.documents, stats.milliseconds, stats.size);
+    }
+    exit(0);
+}
+
+static ngx_int_t ngx_xapian_search_init_module(ngx_cycle_t *cycle) {
+    ngx_xapian_search_main_conf_t *mcf;
+
+    if (ngx_test_config || ngx_process == NGX_PROCESS_SIGNALLER)
+        return NGX_OK;
+
+    mcf = (ngx_xapian_search_main_conf_t*)ngx_http_cycle_get_module_main_conf(cycle, ngx_xapian_search_module);
+    if (mcf == NULL || mcf->builds.nelts == 0)
+        return NGX_OK;
+
+    /* building can take minutes on a large site, so don't hold up startup or reloads; workers serve whatever index is already there in the meantime. */
+    if (ngx_spawn_process(cycle, ngx_xapian_search_builder_process, mcf, (char*)"xapian index builder", NGX_PROCESS_DETACHED) == NGX_INVALID_PID)
+        ngx_log_error(NGX_LOG_ERR, cycle->log, 0, "Failed to spawn xapian index builder.");
+    return NGX_OK;
+}
+
+static ngx_int_t ngx_xapian_search_init_process(ngx_cycle_t *cycle) {
+    ngx_xapian_search_main_conf_t *mcf;
+
+    if (ngx_process != NGX_PROCESS_WORKER && ngx_process != NGX_PROCESS_SINGLE)
+        return NGX_OK;
+
+    mcf = (ngx_xapian_search_main_conf_t*)ngx_http_cycle_get_module_main_conf(cycle, ngx_xapian_search_module);
+    if (mcf == NULL)
+        return NGX_OK;
+
+    /* open a searcher for every index and language up front, so the first search in each worker doesn't pay for it; an index that hasn't been built yet is opened on first use instead. */
+    ngx_xapian_search_conf_t **searchers = (ngx_xapian_search_conf_t**)mcf->searchers.elts;
+    for (ngx_uint_t i = 0; i < mcf->searchers.nelts; ++i) {
+        if (ngx_xapian_open_index((const char*)searchers[i]->index.data, (const char*)searchers[i]->language.data) != 0) {
+            ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0, "Can't open xapian search index %s yet: %s.", searchers[i]->index.data, ngx_xapian_get_error());
+            ngx_xapian_clear_error();
+        }
+    }
+    return NGX_OK;
+}
+
+static void ngx_xapian_search_exit_process(ngx_cycle_t *cycle) {
+    ngx_xapian_close_indexes();
+}
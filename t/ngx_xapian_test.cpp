@@ -1,4 +1,11 @@
 #include <string>
+#include <set>
+#include <cstdio>
+#include <cstring>
+#include <climits>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <dirent.h>
 #include <gtest/gtest.h>
 #include "../src/ngx_xapian_search.h"
 
@@ -43,9 +50,331 @@ TEST(sanity, tmpl) {
 
 }
 
+TEST(sanity, searcher) {
+    ngx_xapian_searcher_t* searcher = ngx_xapian_searcher_open("/tmp/test_index", "en");
+    ASSERT_NE(searcher, nullptr);
+    // Same searcher, several searches; nothing should carry over from one to the next.
+    for (int i = 0; i < 3; ++i) {
+        int results = ngx_xapian_searcher_search(searcher, "Project", 12, +[](ngx_xapian_result_t result, void* data) { }, nullptr);
+        ASSERT_EQ(results, 2);
+        ASSERT_STREQ(ngx_xapian_searcher_get_error(searcher), nullptr);
+    }
+    // Paging; the second page of one result each holds whichever result the first didn't.
+    ngx_xapian_query_t query;
+    ngx_xapian_query_init(&query);
+    query.query = "Project";
+    query.max_results = 1;
+    ASSERT_EQ(ngx_xapian_searcher_query(searcher, &query, +[](ngx_xapian_result_t result, void* data) { }, nullptr), 1);
+    ASSERT_EQ(query.estimated_total, 2);
+    query.offset = 1;
+    ASSERT_EQ(ngx_xapian_searcher_query(searcher, &query, +[](ngx_xapian_result_t result, void* data) { }, nullptr), 1);
+    query.offset = 2;
+    ASSERT_EQ(ngx_xapian_searcher_query(searcher, &query, +[](ngx_xapian_result_t result, void* data) { }, nullptr), 0);
+    unsigned long long revision;
+    ASSERT_EQ(ngx_xapian_searcher_get_revision(searcher, &revision, nullptr), 0);
+    ngx_xapian_searcher_close(searcher);
+
+    ASSERT_EQ(ngx_xapian_searcher_open("/tmp/test_index_does_not_exist", "en"), nullptr);
+    ASSERT_NE(ngx_xapian_get_error(), nullptr);
+}
+
+static void write_document(const char* path, const char* title, const char* description) {
+    FILE* file = fopen(path, "wb");
+    fprintf(file, "<html><head><title>%s</title><meta name='description' content='%s'></head><body>%s</body></html>", title, description, description);
+    fclose(file);
+}
+
+static int search_count(const char* index, const char* query) {
+    return ngx_xapian_search_index(index, "en", query, 12, +[](ngx_xapian_result_t result, void* data) { }, nullptr);
+}
+
+static string render_template(ngx_xapian_searcher_t* searcher, const char* query, const char* tmpl) {
+    void* tmpl_struct = ngx_xapian_parse_template(tmpl, strlen(tmpl));
+    ngx_xapian_query_t search;
+    ngx_xapian_query_init(&search);
+    search.query = query;
+    string output;
+    ngx_xapian_searcher_query_template(searcher, &search, tmpl_struct, +[](const char* chunk, unsigned int chunkSize, void* data) {
+        ((string*)data)->append(chunk, chunkSize);
+    }, &output);
+    ngx_xapian_free_template(tmpl_struct);
+    return output;
+}
+
+TEST(sanity, scope) {
+    ngx_xapian_searcher_t* searcher = ngx_xapian_searcher_open("/tmp/test_index", "en");
+    ASSERT_NE(searcher, nullptr);
+    ASSERT_EQ(render_template(searcher, "Project", "{% assign heading = 'Found' %}{{ heading }} {{ search.total }}"), "Found 2");
+    ASSERT_EQ(render_template(searcher, "Project", "{% capture terms %}[{{ search.terms }}]{% endcapture %}{{ terms }}"), "[Project]");
+    ASSERT_EQ(render_template(searcher, "Project", "{% for result in search.results %}{{ forloop.index }}:{{ result.title }};{% endfor %}"), "1:Document 1;2:Document 2;");
+    // Nothing set by one render is still there for the next.
+    ASSERT_EQ(render_template(searcher, "Project", "[{{ heading }}]"), "[]");
+    ASSERT_EQ(render_template(searcher, "Nonexistent", "[{% for result in search.results %}{{ result.title }}{% endfor %}]{{ search.total }}"), "[]0");
+    ASSERT_STREQ(ngx_xapian_searcher_get_error(searcher), nullptr);
+    ngx_xapian_searcher_close(searcher);
+}
+
+TEST(sanity, incremental) {
+    mkdir("/tmp/test_incremental_corpus", 0755);
+    unlink("/tmp/test_incremental_corpus/document2.html");
+    write_document("/tmp/test_incremental_corpus/document1.html", "Zebra", "Striped");
+    write_document("/tmp/test_incremental_corpus/document2.html", "Giraffe", "Tall");
+    ASSERT_EQ(ngx_xapian_build_index("/tmp/test_incremental_corpus", "en", "/tmp/test_incremental_index", nullptr), 0);
+    ASSERT_EQ(search_count("/tmp/test_incremental_index", "Zebra"), 1);
+    ASSERT_EQ(search_count("/tmp/test_incremental_index", "Giraffe"), 1);
+
+    // Changed files are reindexed, and removed files are dropped from the index.
+    write_document("/tmp/test_incremental_corpus/document1.html", "Okapi", "Shy");
+    unlink("/tmp/test_incremental_corpus/document2.html");
+    ASSERT_EQ(ngx_xapian_build_index("/tmp/test_incremental_corpus", "en", "/tmp/test_incremental_index", nullptr), 0);
+    ASSERT_STREQ(ngx_xapian_get_error(), nullptr);
+    ASSERT_EQ(search_count("/tmp/test_incremental_index", "Zebra"), 0);
+    ASSERT_EQ(search_count("/tmp/test_incremental_index", "Okapi"), 1);
+    ASSERT_EQ(search_count("/tmp/test_incremental_index", "Giraffe"), 0);
+
+    // The index is published as a symlink to the latest generation, with the superseded one cleaned up.
+    struct stat status;
+    ASSERT_EQ(lstat("/tmp/test_incremental_index", &status), 0);
+    ASSERT_TRUE(S_ISLNK(status.st_mode));
+    int generations = 0;
+    DIR* dir = opendir("/tmp/test_incremental_index.generations");
+    ASSERT_NE(dir, nullptr);
+    while (dirent* dp = readdir(dir))
+        generations += dp->d_name[0] != '.';
+    closedir(dir);
+    ASSERT_EQ(generations, 1);
+
+    // A build that finds nothing changed leaves the published generation alone.
+    char before[PATH_MAX] = { 0 }, after[PATH_MAX] = { 0 };
+    ASSERT_GT(readlink("/tmp/test_incremental_index", before, sizeof(before)-1), 0);
+    ASSERT_EQ(ngx_xapian_build_index("/tmp/test_incremental_corpus", "en", "/tmp/test_incremental_index", nullptr), 0);
+    ASSERT_GT(readlink("/tmp/test_incremental_index", after, sizeof(after)-1), 0);
+    ASSERT_STREQ(before, after);
+    ASSERT_EQ(search_count("/tmp/test_incremental_index", "Okapi"), 1);
+    // As does one that finds files touched, but their contents the same.
+    write_document("/tmp/test_incremental_corpus/document1.html", "Okapi", "Shy");
+    ASSERT_EQ(ngx_xapian_build_index("/tmp/test_incremental_corpus", "en", "/tmp/test_incremental_index", nullptr), 0);
+    ASSERT_GT(readlink("/tmp/test_incremental_index", after, sizeof(after)-1), 0);
+    ASSERT_STREQ(before, after);
+}
+
+// What each shard of an index currently points at.
+static set<string> shard_generations(const char* index) {
+    set<string> generations;
+    DIR* dir = opendir((string(index) + ".shards").data());
+    if (!dir)
+        return generations;
+    while (dirent* dp = readdir(dir)) {
+        char link[PATH_MAX];
+        ssize_t length = readlink((string(index) + ".shards/" + dp->d_name).data(), link, sizeof(link));
+        if (length > 0)
+            generations.insert(string(dp->d_name) + " " + string(link, length));
+    }
+    closedir(dir);
+    return generations;
+}
+
+TEST(sanity, shards) {
+    mkdir("/tmp/test_shard_corpus_a", 0755);
+    mkdir("/tmp/test_shard_corpus_b", 0755);
+    write_document("/tmp/test_shard_corpus_a/document1.html", "Walrus", "Tusked");
+    write_document("/tmp/test_shard_corpus_b/document1.html", "Narwhal", "Tusked");
+    const char* directories[] = { "/tmp/test_shard_corpus_a", "/tmp/test_shard_corpus_b" };
+    ngx_xapian_build_options_t options;
+    ngx_xapian_build_options_init(&options);
+    ASSERT_EQ(ngx_xapian_build_shards(directories, nullptr, 2, "en", "/tmp/test_shard_index", &options), 0);
+    ASSERT_EQ(search_count("/tmp/test_shard_index", "Walrus"), 1);
+    ASSERT_EQ(search_count("/tmp/test_shard_index", "Narwhal"), 1);
+    ASSERT_EQ(search_count("/tmp/test_shard_index", "Tusked"), 2);
+
+    // Shards are named after their directories, so listing them in another order, or twice, rebuilds nothing.
+    set<string> published = shard_generations("/tmp/test_shard_index");
+    ASSERT_EQ(published.size(), 2u);
+    const char* reordered[] = { "/tmp/test_shard_corpus_b", "/tmp/test_shard_corpus_a", "/tmp/test_shard_corpus_b" };
+    ASSERT_EQ(ngx_xapian_build_shards(reordered, nullptr, 3, "en", "/tmp/test_shard_index", &options), 0);
+    ASSERT_EQ(shard_generations("/tmp/test_shard_index"), published);
+    ASSERT_EQ(search_count("/tmp/test_shard_index", "Tusked"), 2);
+
+    // Going back to a single directory drops the other shard from searches.
+    ASSERT_EQ(ngx_xapian_build_shards(directories, nullptr, 1, "en", "/tmp/test_shard_index", &options), 0);
+    ASSERT_STREQ(ngx_xapian_get_error(), nullptr);
+    ASSERT_EQ(search_count("/tmp/test_shard_index", "Tusked"), 1);
+    ASSERT_EQ(search_count("/tmp/test_shard_index", "Narwhal"), 0);
+    ASSERT_TRUE(shard_generations("/tmp/test_shard_index").empty());
+}
+
+TEST(sanity, languages) {
+    mkdir("/tmp/test_language_corpus", 0755);
+    FILE* file = fopen("/tmp/test_language_corpus/english.html", "wb");
+    fprintf(file, "<html lang='en-GB'><head><title>Running</title><meta name='description' content='Marathon'></head><body>Marathon</body></html>");
+    fclose(file);
+    file = fopen("/tmp/test_language_corpus/french.html", "wb");
+    fprintf(file, "<html lang='fr'><head><title>Courir</title><meta name='description' content='Marathon'></head><body>Marathon</body></html>");
+    fclose(file);
+    // Far too long to be a language, or a term; it's indexed as the default language instead.
+    string language(300, 'x');
+    file = fopen("/tmp/test_language_corpus/unknown.html", "wb");
+    fprintf(file, "<html lang='%s'><head><title>Jogging</title><meta name='description' content='Marathon'></head><body>Marathon</body></html>", language.data());
+    fclose(file);
+    ASSERT_EQ(ngx_xapian_build_index("/tmp/test_language_corpus", "en", "/tmp/test_language_index", nullptr), 0);
+    ASSERT_STREQ(ngx_xapian_get_error(), nullptr);
+
+    ngx_xapian_searcher_t* searcher = ngx_xapian_searcher_open("/tmp/test_language_index", "en");
+    ASSERT_NE(searcher, nullptr);
+    ngx_xapian_query_t query;
+    ngx_xapian_query_init(&query);
+    query.query = "Marathon";
+    ASSERT_EQ(ngx_xapian_searcher_query(searcher, &query, +[](ngx_xapian_result_t result, void* data) { }, nullptr), 3);
+    // Both the code and the stemmer's name for a language pick out the same documents.
+    query.language = "fr";
+    ASSERT_EQ(ngx_xapian_searcher_query(searcher, &query, +[](ngx_xapian_result_t result, void* data) { }, nullptr), 1);
+    query.language = "english";
+    ASSERT_EQ(ngx_xapian_searcher_query(searcher, &query, +[](ngx_xapian_result_t result, void* data) { }, nullptr), 2);
+    query.language = "de";
+    ASSERT_EQ(ngx_xapian_searcher_query(searcher, &query, +[](ngx_xapian_result_t result, void* data) { }, nullptr), 0);
+    query.language = language.data();
+    ASSERT_EQ(ngx_xapian_searcher_query(searcher, &query, +[](ngx_xapian_result_t result, void* data) { }, nullptr), 0);
+    ASSERT_STREQ(ngx_xapian_searcher_get_error(searcher), nullptr);
+    ngx_xapian_searcher_close(searcher);
+}
+
+TEST(sanity, positions) {
+    mkdir("/tmp/test_positions_corpus", 0755);
+    FILE* file = fopen("/tmp/test_positions_corpus/document1.html", "wb");
+    fprintf(file, "<html><head><title>Marsupial Facts</title><meta name='description' content='Animals'></head><body>Quokka smiling</body></html>");
+    fclose(file);
+    ngx_xapian_build_options_t options;
+    ngx_xapian_build_options_init(&options);
+    options.body_positions = 0;
+    ASSERT_EQ(ngx_xapian_build_index_with_options("/tmp/test_positions_corpus", "en", "/tmp/test_positions_index", nullptr, &options), 0);
+    // Body words are still found, and phrases still match in the title, but not in the body.
+    ASSERT_EQ(search_count("/tmp/test_positions_index", "Quokka"), 1);
+    ASSERT_EQ(search_count("/tmp/test_positions_index", "\"Marsupial Facts\""), 1);
+    ASSERT_EQ(search_count("/tmp/test_positions_index", "\"Quokka smiling\""), 0);
+    // With them, body phrases match too.
+    options.body_positions = 1;
+    ASSERT_EQ(ngx_xapian_build_index_with_options("/tmp/test_positions_corpus", "en", "/tmp/test_positions_index_2", nullptr, &options), 0);
+    ASSERT_EQ(search_count("/tmp/test_positions_index_2", "\"Quokka smiling\""), 1);
+    ASSERT_EQ(search_count("/tmp/test_positions_index_2", "\"Marsupial Facts\""), 1);
+}
+
+TEST(sanity, compact) {
+    mkdir("/tmp/test_compact_corpus", 0755);
+    unlink("/tmp/test_compact_corpus/document2.html");
+    write_document("/tmp/test_compact_corpus/document1.html", "Wombat", "Burrowing");
+    ngx_xapian_build_stats_t stats;
+    ngx_xapian_build_options_t options;
+    ngx_xapian_build_options_init(&options);
+    options.compact = 1;
+    options.stats = &stats;
+    ASSERT_EQ(ngx_xapian_build_index_with_options("/tmp/test_compact_corpus", "en", "/tmp/test_compact_index", nullptr, &options), 0);
+    ASSERT_EQ(stats.documents, 1);
+    ASSERT_GT(stats.compacted_size, 0);
+    ASSERT_LE(stats.compacted_size, stats.size);
+    ASSERT_EQ(search_count("/tmp/test_compact_index", "Wombat"), 1);
+
+    // The next build starts from the compacted one.
+    write_document("/tmp/test_compact_corpus/document2.html", "Echidna", "Spiny");
+    ASSERT_EQ(ngx_xapian_build_index_with_options("/tmp/test_compact_corpus", "en", "/tmp/test_compact_index", nullptr, &options), 0);
+    ASSERT_EQ(stats.documents, 2);
+    ASSERT_EQ(search_count("/tmp/test_compact_index", "Wombat"), 1);
+    ASSERT_EQ(search_count("/tmp/test_compact_index", "Echidna"), 1);
+
+    // A compacted index still knows when it was written.
+    ngx_xapian_searcher_t* searcher = ngx_xapian_searcher_open("/tmp/test_compact_index", "en");
+    ASSERT_NE(searcher, nullptr);
+    unsigned long long revision;
+    time_t modified = 0;
+    ASSERT_EQ(ngx_xapian_searcher_get_revision(searcher, &revision, &modified), 0);
+    ASSERT_GT(modified, 0);
+    ngx_xapian_searcher_close(searcher);
+}
+
+TEST(sanity, batching) {
+    // However often the build commits, it ends up with the same documents.
+    ngx_xapian_build_options_t options;
+    ngx_xapian_build_options_init(&options);
+    // By default, the whole build is one commit.
+    ASSERT_EQ(options.docs_per_commit, 0);
+    options.docs_per_commit = 1;
+    ASSERT_EQ(ngx_xapian_build_index_with_options("t/test_corpus", "en", "/tmp/test_batching_index", nullptr, &options), 0);
+    ASSERT_EQ(search_count("/tmp/test_batching_index", "Project"), 2);
+    options.docs_per_commit = 0;
+    options.memory_budget = 1;
+    ASSERT_EQ(ngx_xapian_build_index_with_options("t/test_corpus", "en", "/tmp/test_batching_index_2", nullptr, &options), 0);
+    ASSERT_EQ(search_count("/tmp/test_batching_index_2", "Project"), 2);
+}
+
+TEST(sanity, escaping) {
+    mkdir("/tmp/test_escaping_corpus", 0755);
+    write_document("/tmp/test_escaping_corpus/document1.html", "Say \"Aardvark\"", "Back\\slash\ttab");
+    ASSERT_EQ(ngx_xapian_build_index("/tmp/test_escaping_corpus", "en", "/tmp/test_escaping_index", nullptr), 0);
+    string json;
+    ASSERT_GT(ngx_xapian_search_index_json("/tmp/test_escaping_index", "en", "Aardvark", 12, +[](const char* chunk, unsigned int chunkSize, void* pointer) {
+        ((string*)pointer)->append(chunk, chunkSize);
+    }, &json), 0);
+    ASSERT_NE(json.find("\"title\":\"Say \\\"Aardvark\\\"\""), string::npos);
+    ASSERT_NE(json.find("\"description\":\"Back\\\\slash\\ttab\""), string::npos);
+}
+
+TEST(sanity, unquoted) {
+    mkdir("/tmp/test_unquoted_corpus", 0755);
+    FILE* file = fopen("/tmp/test_unquoted_corpus/document1.html", "wb");
+    fprintf(file, "<html><head><title>Platypus</title><meta name=description content=Venomous><link rel=canonical href=https://test.com/a/b/></head><body></body></html>");
+    fclose(file);
+    ASSERT_EQ(ngx_xapian_build_index("/tmp/test_unquoted_corpus", "en", "/tmp/test_unquoted_index", nullptr), 0);
+    string json;
+    ASSERT_GT(ngx_xapian_search_index_json("/tmp/test_unquoted_index", "en", "Platypus", 12, +[](const char* chunk, unsigned int chunkSize, void* pointer) {
+        ((string*)pointer)->append(chunk, chunkSize);
+    }, &json), 0);
+    ASSERT_NE(json.find("\"url\":\"https://test.com/a/b/\""), string::npos);
+}
+
+TEST(sanity, body) {
+    mkdir("/tmp/test_body_corpus", 0755);
+    FILE* file = fopen("/tmp/test_body_corpus/document1.html", "wb");
+    fprintf(file, "<html><head><title>Bodies</title><meta name='description' content='Parsing'></head><body>"
+        "<p class='intro'>Visible</p><!-- Commented --><script>var Scripted = '</p>';</script><style>.Styled { }</style>"
+        "<div class='nointernalindex'>Hidden<div>Nested</div></div><p>After<br/>Break</p>caf\xc3\xa9 < Lonely"
+        "</body></html>");
+    fclose(file);
+    ASSERT_EQ(ngx_xapian_build_index("/tmp/test_body_corpus", "en", "/tmp/test_body_index", nullptr), 0);
+    ASSERT_EQ(search_count("/tmp/test_body_index", "Visible"), 1);
+    ASSERT_EQ(search_count("/tmp/test_body_index", "After"), 1);
+    ASSERT_EQ(search_count("/tmp/test_body_index", "Break"), 1);
+    ASSERT_EQ(search_count("/tmp/test_body_index", "Lonely"), 1);
+    ASSERT_EQ(search_count("/tmp/test_body_index", "caf\xc3\xa9"), 1);
+    ASSERT_EQ(search_count("/tmp/test_body_index", "Commented"), 0);
+    ASSERT_EQ(search_count("/tmp/test_body_index", "Scripted"), 0);
+    ASSERT_EQ(search_count("/tmp/test_body_index", "Styled"), 0);
+    ASSERT_EQ(search_count("/tmp/test_body_index", "Hidden"), 0);
+    ASSERT_EQ(search_count("/tmp/test_body_index", "Nested"), 0);
+}
+
+static int etag_matches(const char* header, const char* etag) {
+    return ngx_xapian_etag_matches(header, strlen(header), etag, strlen(etag));
+}
+
+TEST(sanity, etags) {
+    const char* etag = "\"1a2b-3c\"";
+    ASSERT_TRUE(etag_matches("\"1a2b-3c\"", etag));
+    ASSERT_TRUE(etag_matches("W/\"1a2b-3c\"", etag));
+    ASSERT_TRUE(etag_matches("\"1a2b-3c\"", "W/\"1a2b-3c\""));
+    ASSERT_TRUE(etag_matches("\"other\", W/\"1a2b-3c\"", etag));
+    ASSERT_TRUE(etag_matches("\"other\" ,\t\"1a2b-3c\" ", etag));
+    // A comma inside a tag doesn't split it.
+    ASSERT_TRUE(etag_matches("\"a,b\", \"1a2b-3c\"", etag));
+    ASSERT_FALSE(etag_matches("\"a, \"1a2b-3c\"", etag));
+    ASSERT_TRUE(etag_matches("*", etag));
+    ASSERT_TRUE(etag_matches(" * ", etag));
+    ASSERT_FALSE(etag_matches("", etag));
+    ASSERT_FALSE(etag_matches("\"1a2b-3c0\"", etag));
+    ASSERT_FALSE(etag_matches("\"1a2b\"", etag));
+    ASSERT_FALSE(etag_matches("\"1a2b-3c", etag));
+    ASSERT_FALSE(etag_matches("1a2b-3c", etag));
+}
 
 int main(int argc, char **argv) {
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
 };
-